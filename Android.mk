@@ -8,16 +8,7 @@ LOCAL_SRC_FILES := lib/zstd/$(TARGET_ARCH_ABI)/libzstd.a
 
 include $(PREBUILT_STATIC_LIBRARY)
 
-include $(CLEAR_VARS)
-
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/../lua
-LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/zlib
-LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/snappy
-LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/zstd
-LOCAL_MODULE     := cseri
-LOCAL_CFLAGS := -std=c23 -O3 -ffast-math
-LOCAL_CPPFLAGS := -std=c++23 -O3 -ffast-math
-LOCAL_SRC_FILES  := \
+CSERI_SRC_FILES := \
     snappy/snappy-c.cc \
     snappy/snappy-sinksource.cc \
     snappy/snappy-stubs-internal.cc \
@@ -39,11 +30,49 @@ LOCAL_SRC_FILES  := \
     zlib/zutil.c \
     binary.c \
     buffer.c \
+    codec.c \
     cseri.c \
+    dict.c \
+    number.c \
+    options.c \
+    parallel.c \
+    schema.c \
+    snappy_iovec.cc \
+    stats.c \
     text.c
 
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../lua
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/zlib
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/snappy
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/zstd
+LOCAL_MODULE     := cseri
+LOCAL_CFLAGS := -std=c23 -O3 -ffast-math
+LOCAL_CPPFLAGS := -std=c++23 -O3 -ffast-math
+LOCAL_SRC_FILES  := $(CSERI_SRC_FILES)
+
 LOCAL_STATIC_LIBRARIES := luajava
 
 LOCAL_STATIC_LIBRARIES += zstd
 
 include $(BUILD_SHARED_LIBRARY)
+
+# 基准测试程序: ndk-build后推送到设备上运行, 见README
+include $(CLEAR_VARS)
+
+LOCAL_C_INCLUDES := $(LOCAL_PATH)/../lua
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/zlib
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/snappy
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/include/zstd
+LOCAL_MODULE     := cseri_bench
+LOCAL_CFLAGS := -std=c23 -O3 -ffast-math -DCSERI_BENCH_WRAP_MALLOC
+LOCAL_CPPFLAGS := -std=c++23 -O3 -ffast-math
+LOCAL_LDFLAGS := -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free
+LOCAL_SRC_FILES  := $(CSERI_SRC_FILES) bench/cseri_bench.c
+
+LOCAL_STATIC_LIBRARIES := luajava
+
+LOCAL_STATIC_LIBRARIES += zstd
+
+include $(BUILD_EXECUTABLE)
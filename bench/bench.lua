@@ -0,0 +1,281 @@
+-- cseri的Lua层基准测试: 在生成的数据上测tobin/frombin/totxt/fromtxt, 并和string.pack, 纯Lua序列化对比.
+-- 用build/<lua>/lua_bench运行时额外输出每次调用的Lua内存分配次数和峰值, 普通lua解释器运行时这两列为"-"
+--
+-- 用法: lua_bench bench/bench.lua [数据名]
+
+local cseri = require "cseri"
+
+local unpack = table.unpack or unpack
+local load = loadstring or load
+local MIN_TIME = 0.2     -- 每项至少运行的秒数
+local MIN_ITERS = 3
+
+local seed = 12345
+local function rand(n)
+    seed = seed * 16807 % 2147483647
+    return seed % n
+end
+
+local words = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+}
+
+local function sentence(n)
+    local t = {}
+    for i = 1, n do
+        t[i] = words[rand(16) + 1]
+    end
+    return table.concat(t, " ")
+end
+
+-- 测试数据
+local datasets = {
+    {
+        name = "records",
+        gen = function()
+            local t = {}
+            for i = 1, 10000 do
+                t[i] = {
+                    id = 100000 + i,
+                    name = "player_" .. rand(100000),
+                    hp = rand(100000) / 100,
+                    level = rand(60),
+                    online = rand(2) == 1,
+                    pos = {x = rand(20000) - 10000 + 0.5, y = rand(20000) - 10000 + 0.25, z = 0.5},
+                }
+            end
+            return t
+        end,
+    },
+    {
+        name = "numeric",
+        gen = function()
+            local t = {timestamps = {}, counts = {}, samples = {}}
+            for i = 1, 50000 do
+                t.timestamps[i] = i * 1000 + rand(1000)
+                t.counts[i] = rand(200)
+                t.samples[i] = rand(1000000) / 997
+            end
+            return t
+        end,
+    },
+    {
+        name = "config",
+        gen = function()
+            local t = {}
+            for s = 1, 100 do
+                local section = {}
+                for k = 1, 40 do
+                    section[words[rand(16) + 1] .. "_" .. words[rand(16) + 1] .. "_" .. k] = sentence(3 + rand(12))
+                end
+                t["section_" .. s] = section
+            end
+            return t
+        end,
+    },
+    {
+        name = "tree",
+        gen = function()
+            local function node(depth)
+                local n = {name = words[rand(16) + 1], value = rand(1000)}
+                if depth > 0 then
+                    n.children = {}
+                    for i = 1, 4 do
+                        n.children[i] = node(depth - 1)
+                    end
+                end
+                return n
+            end
+            return node(6)
+        end,
+    },
+}
+
+-- 纯Lua序列化: 写成Lua表构造式, 用load读回
+local function lua_serialize(v, out)
+    local tv = type(v)
+    if tv == "table" then
+        out[#out + 1] = "{"
+        for k, e in pairs(v) do
+            out[#out + 1] = "["
+            lua_serialize(k, out)
+            out[#out + 1] = "]="
+            lua_serialize(e, out)
+            out[#out + 1] = ","
+        end
+        out[#out + 1] = "}"
+    elseif tv == "string" then
+        out[#out + 1] = string.format("%q", v)
+    elseif tv == "number" then
+        if math.type and math.type(v) == "integer" then
+            out[#out + 1] = tostring(v)
+        else
+            out[#out + 1] = string.format("%.17g", v)
+        end
+    else
+        out[#out + 1] = tostring(v)
+    end
+    return out
+end
+
+-- string.pack: 按数据的形状手写格式, 代表不带类型信息的最紧凑写法; Lua 5.3以下没有, 跳过
+local packers = {}
+if string.pack then
+    packers.records = {
+        encode = function(t)
+            local out = {string.pack("<I4", #t)}
+            for i, r in ipairs(t) do
+                out[i + 1] = string.pack("<i8s2di4Bddd", r.id, r.name, r.hp, r.level, r.online and 1 or 0,
+                    r.pos.x, r.pos.y, r.pos.z)
+            end
+            return table.concat(out)
+        end,
+        decode = function(s)
+            local n, pos = string.unpack("<I4", s)
+            local t = {}
+            for i = 1, n do
+                local id, name, hp, level, online, x, y, z
+                id, name, hp, level, online, x, y, z, pos = string.unpack("<i8s2di4Bddd", s, pos)
+                t[i] = {id = id, name = name, hp = hp, level = level, online = online == 1, pos = {x = x, y = y, z = z}}
+            end
+            return t
+        end,
+    }
+
+    -- 数组分段打包, 避免一次传入过多参数
+    local CHUNK = 1000
+    local function pack_array(fmt, a)
+        local out = {string.pack("<I4", #a)}
+        for i = 1, #a, CHUNK do
+            local j = math.min(i + CHUNK - 1, #a)
+            out[#out + 1] = string.pack("<" .. string.rep(fmt, j - i + 1), unpack(a, i, j))
+        end
+        return table.concat(out)
+    end
+
+    local function unpack_array(fmt, s, pos)
+        local n
+        n, pos = string.unpack("<I4", s, pos)
+        local a = {}
+        for i = 1, n, CHUNK do
+            local j = math.min(i + CHUNK - 1, n)
+            local r = {string.unpack("<" .. string.rep(fmt, j - i + 1), s, pos)}
+            pos = r[#r]
+            for k = 1, j - i + 1 do
+                a[i + k - 1] = r[k]
+            end
+        end
+        return a, pos
+    end
+
+    packers.numeric = {
+        encode = function(t)
+            return pack_array("i8", t.timestamps) .. pack_array("i8", t.counts) .. pack_array("d", t.samples)
+        end,
+        decode = function(s)
+            local t = {}
+            local pos
+            t.timestamps, pos = unpack_array("i8", s, 1)
+            t.counts, pos = unpack_array("i8", s, pos)
+            t.samples = unpack_array("d", s, pos)
+            return t
+        end,
+    }
+end
+
+local methods = {
+    {
+        name = "tobin",
+        encode = function(t) return cseri.tobin(t, false) end,
+        decode = function(s) return cseri.frombin(s, false) end,
+    },
+    {
+        name = "tobin snappy",
+        encode = function(t) return cseri.tobin(t) end,
+        decode = function(s) return cseri.frombin(s) end,
+    },
+    {
+        name = "tobin zstd",
+        encode = function(t) return cseri.tobin(t, "zstd", 3) end,
+        decode = function(s) return cseri.frombin(s, "zstd") end,
+    },
+    {
+        name = "totxt",
+        encode = function(t) return cseri.totxt(t) end,
+        decode = function(s) return cseri.fromtxt(s) end,
+    },
+    {
+        name = "string.pack",
+        encode = function(t, data) return packers[data].encode(t) end,
+        decode = function(s, data) return packers[data].decode(s) end,
+        available = function(data) return packers[data] ~= nil end,
+    },
+    {
+        name = "pure lua",
+        encode = function(t) return table.concat(lua_serialize(t, {})) end,
+        decode = function(s) return load("return " .. s)() end,
+    },
+}
+
+-- 反复调用f, 返回每次调用的平均秒数
+local function measure(f, ...)
+    local iters, total = 0, 0
+    while iters < MIN_ITERS or total < MIN_TIME do
+        local t = os.clock()
+        f(...)
+        total = total + os.clock() - t
+        iters = iters + 1
+    end
+    return total / iters
+end
+
+-- 单独调用一次f, 返回分配次数和内存峰值; 宿主程序没有提供统计时返回nil
+local function allocs(f, ...)
+    if not bench_alloc_reset then
+        return nil
+    end
+    collectgarbage()
+    bench_alloc_reset()
+    f(...)
+    return bench_alloc_stats()
+end
+
+local function fmt_allocs(count, peak)
+    if not count then
+        return string.format("%10s %10s", "-", "-")
+    end
+    return string.format("%10d %10d", count, peak)
+end
+
+local only = arg and arg[1]
+print(string.format("%s, %s", _VERSION, jit and jit.version or "no jit"))
+print(string.format("%-8s %-12s %10s %9s %9s %10s %10s %10s %10s",
+    "data", "method", "bytes", "enc ms", "dec ms", "enc allocs", "enc peak", "dec allocs", "dec peak"))
+for _, ds in ipairs(datasets) do
+    if not only or only == ds.name then
+        local data = ds.gen()
+        for _, m in ipairs(methods) do
+            if not m.available or m.available(ds.name) then
+                -- 纯Lua的load在旧版本上可能超出常量数量限制, 失败时只输出原因
+                local ok, s = pcall(m.encode, data, ds.name)
+                local err
+                if ok then
+                    ok, err = pcall(m.decode, s, ds.name)
+                else
+                    err = s
+                end
+                if ok then
+                    local enc = measure(m.encode, data, ds.name)
+                    local dec = measure(m.decode, s, ds.name)
+                    local enc_count, enc_peak = allocs(m.encode, data, ds.name)
+                    local dec_count, dec_peak = allocs(m.decode, s, ds.name)
+                    print(string.format("%-8s %-12s %10d %9.3f %9.3f %s %s", ds.name, m.name, #s,
+                        enc * 1000, dec * 1000, fmt_allocs(enc_count, enc_peak), fmt_allocs(dec_count, dec_peak)))
+                else
+                    print(string.format("%-8s %-12s 失败: %s", ds.name, m.name, tostring(err)))
+                end
+            end
+        end
+    end
+end
@@ -0,0 +1,372 @@
+// cseri基准测试: 生成几类典型数据, 对每种压缩方式和级别测量序列化, 压缩, 解压, 反序列化的吞吐量,
+// 压缩率和每次调用的内存分配次数. 参考snappy_benchmark.cc的BM_ZFlat/BM_UFlat, 不依赖benchmark库.
+//
+// 用法: cseri_bench [数据名] [压缩方式[:级别]]
+//   cseri_bench                   全部数据, 全部压缩方式和级别
+//   cseri_bench records zstd      只测records数据的Zstd各级别
+//   cseri_bench all zlib:6        全部数据, 只测Zlib 6级
+//
+// 时间列说明: encode/decode为不压缩时tobin/frombin的吞吐量, tobin/frombin为带压缩的整体吞吐量,
+// compress/decompress由两者的时间差得出. 吞吐量都按序列化后的原始长度计算.
+// C分配次数通过链接参数-Wl,--wrap=malloc等统计, 只对静态链接进来的代码有效: cseri和zlib总是包含在内,
+// zstd只有链接静态库时才计入(Android.mk用的是预编译的libzstd.a); 链接共享库libzstd.so时zstd内部的
+// malloc不经过--wrap, 不计入C分配次数. Lua分配次数通过lua_Alloc统计
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#define BENCH_MIN_TIME 0.2     // 每项至少运行的秒数
+#define BENCH_MIN_ITERS 3
+
+int luaopen_cseri(lua_State *L);
+
+// 内存分配统计
+static struct {
+    uint64_t c_allocs;
+    uint64_t lua_allocs;
+    size_t lua_bytes;
+    size_t lua_peak;
+} stats;
+
+#ifdef CSERI_BENCH_WRAP_MALLOC
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+void __real_free(void *p);
+
+void *__wrap_malloc(size_t size) {
+    stats.c_allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    stats.c_allocs++;
+    return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+    stats.c_allocs++;
+    return __real_realloc(p, size);
+}
+
+void __wrap_free(void *p) {
+    __real_free(p);
+}
+
+#define raw_realloc __real_realloc
+#define raw_free __real_free
+#else
+#define raw_realloc realloc
+#define raw_free free
+#endif
+
+static void *bench_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    (void)ud;
+    if (ptr)
+        stats.lua_bytes -= osize;
+    if (nsize == 0) {
+        raw_free(ptr);
+        return NULL;
+    }
+    void *p = raw_realloc(ptr, nsize);
+    if (p) {
+        stats.lua_allocs++;
+        stats.lua_bytes += nsize;
+        if (stats.lua_bytes > stats.lua_peak)
+            stats.lua_peak = stats.lua_bytes;
+    } else if (ptr) {
+        stats.lua_bytes += osize;
+    }
+    return p;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 生成测试数据, 结果压入栈顶
+static uint32_t rand_state = 12345;
+
+static uint32_t next_rand(void) {
+    rand_state = rand_state * 1103515245 + 12345;
+    return rand_state >> 8;
+}
+
+static const char *words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+};
+
+static void push_sentence(lua_State *L, int count) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 0; i < count; ++i) {
+        if (i) luaL_addchar(&b, ' ');
+        luaL_addstring(&b, words[next_rand() % 16]);
+    }
+    luaL_pushresult(&b);
+}
+
+// 玩家记录数组: 固定字段的小table
+static void gen_records(lua_State *L) {
+    int n = 20000;
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; ++i) {
+        lua_createtable(L, 0, 6);
+        lua_pushinteger(L, 100000 + i);
+        lua_setfield(L, -2, "id");
+        lua_pushfstring(L, "player_%d", (int)(next_rand() % 100000));
+        lua_setfield(L, -2, "name");
+        lua_pushnumber(L, (next_rand() % 100000) / 100.0);
+        lua_setfield(L, -2, "hp");
+        lua_pushinteger(L, next_rand() % 60);
+        lua_setfield(L, -2, "level");
+        lua_pushboolean(L, next_rand() & 1);
+        lua_setfield(L, -2, "online");
+        lua_createtable(L, 0, 3);
+        lua_pushnumber(L, (int)(next_rand() % 20000) - 10000.0 + 0.5);
+        lua_setfield(L, -2, "x");
+        lua_pushnumber(L, (int)(next_rand() % 20000) - 10000.0 + 0.25);
+        lua_setfield(L, -2, "y");
+        lua_pushnumber(L, 0.0);
+        lua_setfield(L, -2, "z");
+        lua_setfield(L, -2, "pos");
+        lua_rawseti(L, -2, i);
+    }
+}
+
+// 数值数组: 整数序列, 小范围整数, 浮点数
+static void gen_numeric(lua_State *L) {
+    int n = 100000;
+    lua_createtable(L, 0, 3);
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; ++i) {
+        lua_pushinteger(L, (lua_Integer)i * 1000 + next_rand() % 1000);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setfield(L, -2, "timestamps");
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; ++i) {
+        lua_pushinteger(L, next_rand() % 200);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setfield(L, -2, "counts");
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; ++i) {
+        lua_pushnumber(L, (next_rand() % 1000000) / 997.0);
+        lua_rawseti(L, -2, i);
+    }
+    lua_setfield(L, -2, "samples");
+}
+
+// 字符串为主的配置表
+static void gen_config(lua_State *L) {
+    int sections = 200, keys = 40;
+    lua_createtable(L, 0, sections);
+    for (int s = 0; s < sections; ++s) {
+        lua_createtable(L, 0, keys);
+        for (int k = 0; k < keys; ++k) {
+            lua_pushfstring(L, "%s_%s_%d", words[next_rand() % 16], words[next_rand() % 16], k);
+            push_sentence(L, 3 + next_rand() % 12);
+            lua_rawset(L, -3);
+        }
+        lua_pushfstring(L, "section_%d", s);
+        lua_insert(L, -2);
+        lua_rawset(L, -3);
+    }
+}
+
+// 深层树: 每个节点4个子节点, 每层节点在序列化时占两层深度, 总深度不超过MAX_DEPTH
+static void gen_tree_node(lua_State *L, int depth) {
+    lua_createtable(L, 0, 3);
+    lua_pushstring(L, words[next_rand() % 16]);
+    lua_setfield(L, -2, "name");
+    lua_pushinteger(L, next_rand() % 1000);
+    lua_setfield(L, -2, "value");
+    if (depth > 0) {
+        lua_createtable(L, 4, 0);
+        for (int i = 1; i <= 4; ++i) {
+            gen_tree_node(L, depth - 1);
+            lua_rawseti(L, -2, i);
+        }
+        lua_setfield(L, -2, "children");
+    }
+}
+
+static void gen_tree(lua_State *L) {
+    gen_tree_node(L, 7);
+}
+
+static const struct {
+    const char *name;
+    void (*gen)(lua_State *L);
+} corpora[] = {
+    {"records", gen_records},
+    {"numeric", gen_numeric},
+    {"config", gen_config},
+    {"tree", gen_tree},
+};
+
+#define CORPUS_COUNT (int)(sizeof(corpora) / sizeof(corpora[0]))
+
+struct result {
+    double seconds;     // 每次调用的平均时间
+    double c_allocs;    // 每次调用的平均分配次数
+    double lua_allocs;
+};
+
+// 反复调用cseri[fn](栈上nargs个参数), 直到累计时间超过BENCH_MIN_TIME. 最后一次的结果留在栈顶
+static struct result run(lua_State *L, const char *fn, int nargs) {
+    int base = lua_gettop(L) - nargs;
+    lua_getglobal(L, "cseri");
+    lua_getfield(L, -1, fn);
+    lua_remove(L, -2);
+    int func = lua_gettop(L);
+    struct result r = {0, 0, 0};
+    int iters = 0;
+    double total = 0;
+    uint64_t c_allocs = stats.c_allocs, lua_allocs = stats.lua_allocs;
+    while (iters < BENCH_MIN_ITERS || total < BENCH_MIN_TIME) {
+        lua_settop(L, func);
+        lua_pushvalue(L, func);
+        for (int i = 1; i <= nargs; ++i)
+            lua_pushvalue(L, base + i);
+        double t = now();
+        lua_call(L, nargs, 1);
+        total += now() - t;
+        ++iters;
+    }
+    r.seconds = total / iters;
+    r.c_allocs = (double)(stats.c_allocs - c_allocs) / iters;
+    r.lua_allocs = (double)(stats.lua_allocs - lua_allocs) / iters;
+    lua_replace(L, base + 1);
+    lua_settop(L, base + 1);
+    return r;
+}
+
+static double mbps(size_t bytes, double seconds) {
+    return seconds > 0 ? bytes / seconds / (1024.0 * 1024.0) : 0;
+}
+
+static void print_diff(const char *codec, size_t bytes, double total, double base) {
+    if (strcmp(codec, "none") != 0 && total > base)
+        printf(" %9.1f", mbps(bytes, total - base));
+    else
+        printf(" %9s", "-");
+}
+
+// 测一种压缩方式和级别; 栈顶是测试数据. codec为"none"时level忽略
+static void bench_codec(lua_State *L, const char *corpus, const char *codec, int level,
+        size_t raw, struct result enc_none, struct result dec_none) {
+    int data = lua_gettop(L);
+    lua_pushvalue(L, data);
+    lua_pushstring(L, codec);
+    lua_pushinteger(L, level);
+    struct result enc = run(L, "tobin", 3);
+    size_t compressed;
+    lua_tolstring(L, -1, &compressed);
+    struct result dec = run(L, "frombin", 1);
+    lua_settop(L, data);
+
+    printf("%-8s %-6s %5d %10zu %10zu %6.2f %9.1f %9.1f", corpus, codec, level, raw, compressed,
+            (double)raw / compressed, mbps(raw, enc_none.seconds), mbps(raw, enc.seconds));
+    print_diff(codec, raw, enc.seconds, enc_none.seconds);
+    printf(" %9.1f %9.1f", mbps(raw, dec_none.seconds), mbps(raw, dec.seconds));
+    print_diff(codec, raw, dec.seconds, dec_none.seconds);
+    printf(" %7.0f/%-7.0f %7.0f/%-7.0f\n", enc.c_allocs, enc.lua_allocs, dec.c_allocs, dec.lua_allocs);
+    fflush(stdout);
+}
+
+// 参数中的压缩方式过滤, 例如"zstd"或"zlib:6"
+static int codec_selected(const char *filter, const char *codec, int level) {
+    if (filter == NULL)
+        return 1;
+    size_t n = strcspn(filter, ":");
+    if (strlen(codec) != n || strncmp(filter, codec, n) != 0)
+        return 0;
+    return filter[n] == '\0' || atoi(filter + n + 1) == level;
+}
+
+static void bench_corpus(lua_State *L, int index, const char *codec_filter) {
+    const char *name = corpora[index].name;
+    corpora[index].gen(L);
+    int data = lua_gettop(L);
+
+    // 不压缩时的序列化和反序列化作为基准
+    lua_pushvalue(L, data);
+    lua_pushboolean(L, 0);
+    struct result enc_none = run(L, "tobin", 2);
+    size_t raw;
+    lua_tolstring(L, -1, &raw);
+    struct result dec_none = run(L, "frombin", 1);
+    lua_settop(L, data);
+
+    if (codec_selected(codec_filter, "none", 0))
+        bench_codec(L, name, "none", 0, raw, enc_none, dec_none);
+    if (codec_selected(codec_filter, "snappy", 1))
+        bench_codec(L, name, "snappy", 1, raw, enc_none, dec_none);
+    for (int level = Z_BEST_SPEED; level <= Z_BEST_COMPRESSION; ++level) {
+        if (codec_selected(codec_filter, "zlib", level))
+            bench_codec(L, name, "zlib", level, raw, enc_none, dec_none);
+    }
+    // Zstd的负数级别范围很大, 只测几个有代表性的
+    static const int zstd_fast[] = {-50, -10, -5, -1};
+    for (size_t i = 0; i < sizeof(zstd_fast) / sizeof(zstd_fast[0]); ++i) {
+        if (zstd_fast[i] >= ZSTD_minCLevel() && codec_selected(codec_filter, "zstd", zstd_fast[i]))
+            bench_codec(L, name, "zstd", zstd_fast[i], raw, enc_none, dec_none);
+    }
+    for (int level = 1; level <= ZSTD_maxCLevel(); ++level) {
+        if (codec_selected(codec_filter, "zstd", level))
+            bench_codec(L, name, "zstd", level, raw, enc_none, dec_none);
+    }
+    lua_settop(L, data - 1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *corpus_filter = argc > 1 && strcmp(argv[1], "all") != 0 ? argv[1] : NULL;
+    const char *codec_filter = argc > 2 ? argv[2] : NULL;
+
+    int matched = corpus_filter == NULL;
+    for (int i = 0; i < CORPUS_COUNT; ++i) {
+        if (corpus_filter && strcmp(corpus_filter, corpora[i].name) == 0)
+            matched = 1;
+    }
+    if (!matched) {
+        fprintf(stderr, "未知的数据名: %s, 可选:", corpus_filter);
+        for (int i = 0; i < CORPUS_COUNT; ++i)
+            fprintf(stderr, " %s", corpora[i].name);
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    // LuaJIT的64位版本不支持自定义分配器, 这时Lua分配次数显示为0
+    lua_State *L = lua_newstate(bench_alloc, NULL);
+    if (L == NULL)
+        L = luaL_newstate();
+    luaL_openlibs(L);
+    luaopen_cseri(L);
+    lua_setglobal(L, "cseri");
+
+    printf("%-8s %-6s %5s %10s %10s %6s %9s %9s %9s %9s %9s %9s %15s %15s\n",
+            "data", "codec", "level", "raw", "packed", "ratio", "encode", "tobin", "compress",
+            "decode", "frombin", "decomp", "tobin C/Lua", "frombin C/Lua");
+    printf("%-8s %-6s %5s %10s %10s %6s %9s %9s %9s %9s %9s %9s %15s %15s\n",
+            "", "", "", "bytes", "bytes", "", "MB/s", "MB/s", "MB/s", "MB/s", "MB/s", "MB/s", "allocs", "allocs");
+    for (int i = 0; i < CORPUS_COUNT; ++i) {
+        if (corpus_filter == NULL || strcmp(corpus_filter, corpora[i].name) == 0)
+            bench_corpus(L, i, codec_filter);
+    }
+    printf("Lua内存峰值: %zu bytes\n", stats.lua_peak);
+    lua_close(L);
+    return 0;
+}
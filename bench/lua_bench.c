@@ -0,0 +1,89 @@
+// bench.lua的宿主程序: 用计数的lua_Alloc创建lua_State, 让脚本能拿到每次调用的分配次数和内存峰值.
+// 普通lua解释器也能运行bench.lua, 只是没有分配统计
+//
+// 脚本中可用的函数:
+//   bench_alloc_reset()   清零分配次数, 以当前内存为起点重新记录峰值
+//   bench_alloc_stats()   返回reset以来的分配次数, 以及超出起点的内存峰值(字节)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+static struct {
+    size_t count;
+    size_t bytes;
+    size_t base;
+    size_t peak;
+} stats;
+
+static void *bench_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+    (void)ud;
+    // ptr为NULL时osize是对象类型而不是长度
+    if (ptr)
+        stats.bytes -= osize;
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+    void *p = realloc(ptr, nsize);
+    if (p == NULL) {
+        if (ptr)
+            stats.bytes += osize;
+        return NULL;
+    }
+    stats.count++;
+    stats.bytes += nsize;
+    if (stats.bytes > stats.peak)
+        stats.peak = stats.bytes;
+    return p;
+}
+
+static int alloc_reset(lua_State *L) {
+    (void)L;
+    stats.count = 0;
+    stats.base = stats.bytes;
+    stats.peak = stats.bytes;
+    return 0;
+}
+
+static int alloc_stats(lua_State *L) {
+    lua_pushnumber(L, (lua_Number)stats.count);
+    lua_pushnumber(L, (lua_Number)(stats.peak - stats.base));
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    const char *script = argc > 1 ? argv[1] : "bench/bench.lua";
+
+    // LuaJIT的64位版本不支持自定义分配器, 这时不提供分配统计
+    lua_State *L = lua_newstate(bench_alloc, NULL);
+    if (L) {
+        lua_register(L, "bench_alloc_reset", alloc_reset);
+        lua_register(L, "bench_alloc_stats", alloc_stats);
+    } else {
+        L = luaL_newstate();
+        if (L == NULL) {
+            fprintf(stderr, "无法创建lua_State\n");
+            return 1;
+        }
+    }
+    luaL_openlibs(L);
+
+    // 脚本之后的参数放进arg表
+    lua_createtable(L, argc, 0);
+    for (int i = 1; i < argc; ++i) {
+        lua_pushstring(L, argv[i]);
+        lua_rawseti(L, -2, i - 1);
+    }
+    lua_setglobal(L, "arg");
+
+    int rc = 0;
+    if (luaL_loadfile(L, script) || lua_pcall(L, 0, 0, 0)) {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        rc = 1;
+    }
+    lua_close(L);
+    return rc;
+}
@@ -1,170 +1,697 @@
 #include <lauxlib.h>
+#if LUA_VERSION_NUM < 502
+#include <lualib.h>
+#endif
+#include <float.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <zlib.h> // Zlib
-#include <snappy-c.h> // Google Snappy
-#include <zstd.h> // Zstd
 #include "common.h"
 #include "buffer.h"
+#include "codec.h"
+#include "dict.h"
+#include "options.h"
+#include "schema.h"
+#include "stats.h"
 
 #define TYPE_NIL 0
 #define TYPE_BOOLEAN 1
 // hibits 0 false 1 true
 
 #define TYPE_NUMBER 2
-// hibits 0 : 0 , 1: byte, 2:word, 4: dword, 6: qword, 8 : double
+// hibits 0 : 0 , 1: byte, 2:word, 3: zigzag varint, 4: dword, 6: qword, 8 : double
 #define TYPE_NUMBER_ZERO 0
 #define TYPE_NUMBER_BYTE 1
 #define TYPE_NUMBER_WORD 2
+#define TYPE_NUMBER_VARINT 3
 #define TYPE_NUMBER_DWORD 4
 #define TYPE_NUMBER_QWORD 6
 #define TYPE_NUMBER_REAL 8
 
 #define TYPE_USERDATA 3
+// 扩展类型, hibits为子类型
+#define TYPE_EXT_INTERN 0       // 开启字符串驻留并清空驻留表
+#define TYPE_EXT_STRING_REF 1   // 驻留表中的字符串, 后跟varint序号
+#define TYPE_EXT_SHARED 2       // 开启table引用并清空引用表
+#define TYPE_EXT_TABLE_REF 3    // 引用表中的table, 后跟varint序号
+#define TYPE_EXT_SCHEMA_DEF 4   // schema定义: varint序号 varint字段数 字段名..., 后面紧跟使用它的记录
+#define TYPE_EXT_RECORD 5       // 按schema写出的table: varint序号 按字段顺序的值...
+#define TYPE_EXT_PACKED 6       // 同类型数组: 元素类型 varint长度 紧密排列的元素, 后面是同普通table的hash部分
+#define TYPE_EXT_FUNCTIONS 7    // 开启函数引用并清空函数表, 后面紧跟第一个函数
+#define TYPE_EXT_FUNCTION_REF 8 // 函数表中的函数, 后跟varint序号
 #define TYPE_SHORT_STRING 4
 // hibits 0~31 : len
 #define TYPE_LONG_STRING 5
+// hibits 1: varint长度, 2: 2字节长度, 4: 4字节长度
 #define TYPE_TABLE 6
 #define TYPE_FUNCTION 7
 
 #define MAX_COOKIE 32
+#define FUNCTION_CACHE_MAX 1024 // 字节码加载缓存最多保留的函数个数
 #define COMBINE_TYPE(t,v) ((t) | (v) << 3)
 
+// 开启驻留后, 长度2~31的字符串第一次出现时原样写出, 双方按出现顺序记入驻留表, 之后只写序号
+#define INTERN_MIN_LEN 2
+#define INTERN_MAX_COUNT 0x10000
+// 开启table引用后, 每个table第一次出现时按开始序列化的顺序编号, 再次出现(包括循环引用)时只写序号
+
+// 同类型数组的元素类型, 整数按小端序存放
+#define PACKED_BOOLEAN 0    // 每个元素1位, 低位在前
+#define PACKED_INT8 1
+#define PACKED_INT16 2
+#define PACKED_INT32 3
+#define PACKED_INT64 4
+#define PACKED_UINT8 5
+#define PACKED_UINT16 6
+#define PACKED_UINT32 7
+#define PACKED_FLOAT 8      // 可以无损转成float的浮点数
+#define PACKED_DOUBLE 9
+#define PACKED_MIN_COUNT 8  // 元素少于这个数时按普通数组写出
+#define PACKED_BATCH 256    // 每批编解码的元素数, 需要是8的倍数
+
+static const int packed_width[] = {0, 1, 2, 4, 8, 1, 2, 4, 4, 8};
+
 #define buffer_append(bf, data, len) buffer_append(bf, (char*)data, len)
 
 #define MAX_LUA_INTEGER  (1ULL << (sizeof(lua_Integer) * 8 - 1)) - 1
 
-/* dummy union to get native endianness */
-static const union {
-  int dummy;
-  char little;  /* true iff machine is little endian */
-} nativeendian = {1};
-
-inline static void
-_convert(char *p, size_t size) {
-    if (!nativeendian.little) return;
-    for (size_t i = 0; i < size / 2; ++i) {
-        char t = p[i];
-        p[i] = p[size - i - 1];
-        p[size - i - 1] = t;
-    }
+// 多字节整数按大端序存放
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define BE16(x) __builtin_bswap16(x)
+#define BE32(x) __builtin_bswap32(x)
+#define BE64(x) __builtin_bswap64(x)
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BE16(x) (x)
+#define BE32(x) (x)
+#define BE64(x) (x)
+#endif
+
+#ifdef BE16
+static inline void store_be16(uint8_t *p, uint16_t v) { v = BE16(v); memcpy(p, &v, 2); }
+static inline void store_be32(uint8_t *p, uint32_t v) { v = BE32(v); memcpy(p, &v, 4); }
+static inline void store_be64(uint8_t *p, uint64_t v) { v = BE64(v); memcpy(p, &v, 8); }
+static inline uint16_t load_be16(const void *p) { uint16_t v; memcpy(&v, p, 2); return BE16(v); }
+static inline uint32_t load_be32(const void *p) { uint32_t v; memcpy(&v, p, 4); return BE32(v); }
+static inline uint64_t load_be64(const void *p) { uint64_t v; memcpy(&v, p, 8); return BE64(v); }
+#else
+static inline void store_be16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = (uint8_t)v; }
+static inline void store_be32(uint8_t *p, uint32_t v) { store_be16(p, v >> 16); store_be16(p + 2, (uint16_t)v); }
+static inline void store_be64(uint8_t *p, uint64_t v) { store_be32(p, v >> 32); store_be32(p + 4, (uint32_t)v); }
+static inline uint16_t load_be16(const void *p) { const uint8_t *b = p; return (uint16_t)(b[0] << 8 | b[1]); }
+static inline uint32_t load_be32(const void *p) { const uint8_t *b = p; return (uint32_t)load_be16(b) << 16 | load_be16(b + 2); }
+static inline uint64_t load_be64(const void *p) { const uint8_t *b = p; return (uint64_t)load_be32(b) << 32 | load_be32(b + 4); }
+#endif
+
+// 以下append_*先用buffer_reserve取得足够的连续空间, 类型字节和数据一次写入
+
+static inline void append_varint(struct buffer *bf, uint64_t v) {
+    uint8_t *p = (uint8_t *)buffer_reserve(bf, MAX_VARINT_SIZE);
+    buffer_commit(bf, varint_encode(v, p));
 }
 
-#define CONVERT(n) _convert((char*)&(n), sizeof(n))
-
 static inline void append_nil(struct buffer *bf) {
-    uint8_t n = TYPE_NIL;
-    buffer_append(bf, (char*)&n, 1);
+    buffer_append_char(bf, TYPE_NIL);
 }
 
 static inline void append_boolean(struct buffer *bf, int boolean) {
-    uint8_t n = COMBINE_TYPE(TYPE_BOOLEAN , boolean ? 1 : 0);
-    buffer_append(bf, (char*)&n, 1);
+    buffer_append_char(bf, COMBINE_TYPE(TYPE_BOOLEAN , boolean ? 1 : 0));
 }
 
 static inline void append_integer(struct buffer *bf, int64_t v) {
-    uint8_t n = COMBINE_TYPE(TYPE_NUMBER, 0);
+    uint8_t *p = (uint8_t *)buffer_reserve(bf, 9);
     if (v == 0) {
-        n = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_ZERO);
-        buffer_append(bf, (char*)&n, 1);
+        p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_ZERO);
+        buffer_commit(bf, 1);
     } else if (v != (int32_t)v) {
-        n = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_QWORD);
-        int64_t v64 = v;
-        CONVERT(v64);
-        buffer_append(bf, (char*)&n, 1);
-        buffer_append(bf, (char*)&v64, sizeof(v64));
+        p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_QWORD);
+        store_be64(p + 1, (uint64_t)v);
+        buffer_commit(bf, 9);
     } else if (v < 0) {
-        int32_t v32 = (int32_t)v;
-        CONVERT(v32);
-        n = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_DWORD);
-        buffer_append(bf, (char*)&n, 1);
-        buffer_append(bf, (char*)&v32, sizeof(v32));
+        p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_DWORD);
+        store_be32(p + 1, (uint32_t)v);
+        buffer_commit(bf, 5);
     } else if (v < 0x100) {
-        uint8_t byte = (uint8_t)v;
-        n = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_BYTE);
-        buffer_append(bf, (char*)&n, 1);
-        buffer_append(bf, (char*)&byte, sizeof(byte));
+        p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_BYTE);
+        p[1] = (uint8_t)v;
+        buffer_commit(bf, 2);
     } else if (v < 0x10000) {
-        uint16_t word = (uint16_t)v;
-        CONVERT(word);
-        n = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_WORD);
-        buffer_append(bf, (char*)&n, 1);
-        buffer_append(bf, (char*)&word, sizeof(word));
+        p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_WORD);
+        store_be16(p + 1, (uint16_t)v);
+        buffer_commit(bf, 3);
     } else {
-        uint32_t v32 = (uint32_t)v;
-        CONVERT(v32);
-        n = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_DWORD);
-        buffer_append(bf, (char*)&n, 1);
-        buffer_append(bf, (char*)&v32, sizeof(v32));
+        p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_DWORD);
+        store_be32(p + 1, (uint32_t)v);
+        buffer_commit(bf, 5);
+    }
+}
+
+// append_integer写出的长度
+static inline size_t
+integer_size(int64_t v) {
+    if (v == 0) return 1;
+    if (v != (int32_t)v) return 9;
+    if (v < 0) return 5;
+    if (v < 0x100) return 2;
+    if (v < 0x10000) return 3;
+    return 5;
+}
+
+// varint格式的整数: 写成zigzag varint, 只在比append_integer的定长写法更短时使用
+static inline void append_varint_integer(struct buffer *bf, int64_t v) {
+    uint64_t zz = (uint64_t)v << 1 ^ (uint64_t)(v >> 63);
+    size_t len = 2;
+    for (uint64_t x = zz >> 7; x; x >>= 7)
+        len++;
+    if (len >= integer_size(v)) {
+        append_integer(bf, v);
+        return;
     }
+    uint8_t *p = (uint8_t *)buffer_reserve(bf, 1 + MAX_VARINT_SIZE);
+    p[0] = COMBINE_TYPE(TYPE_NUMBER, TYPE_NUMBER_VARINT);
+    buffer_commit(bf, 1 + varint_encode(zz, p + 1));
 }
 
 static inline void append_real(struct buffer *bf, double v) {
-    uint8_t n = COMBINE_TYPE(TYPE_NUMBER , TYPE_NUMBER_REAL);
-    buffer_append(bf, (char*)&n, 1);
-    buffer_append(bf, (char*)&v, sizeof(v));
+    char *p = buffer_reserve(bf, 1 + sizeof(v));
+    p[0] = COMBINE_TYPE(TYPE_NUMBER , TYPE_NUMBER_REAL);
+    memcpy(p + 1, &v, sizeof(v));
+    buffer_commit(bf, 1 + sizeof(v));
 }
 
-static inline void append_string(struct buffer *bf, const char *str, int len) {
+static inline void append_string(struct buffer *bf, const char *str, int len, int varint) {
     if (len < MAX_COOKIE) {
-        uint8_t n = COMBINE_TYPE(TYPE_SHORT_STRING, len);
-        buffer_append(bf, (char*)&n, 1);
-        if (len > 0) {
-            buffer_append(bf, str, len);
-        }
+        char *p = buffer_reserve(bf, MAX_COOKIE);
+        p[0] = COMBINE_TYPE(TYPE_SHORT_STRING, len);
+        memcpy(p + 1, str, len);
+        buffer_commit(bf, 1 + len);
+        return;
+    }
+    uint8_t *p = (uint8_t *)buffer_reserve(bf, 1 + MAX_VARINT_SIZE);
+    if (varint) {
+        p[0] = COMBINE_TYPE(TYPE_LONG_STRING, 1);
+        buffer_commit(bf, 1 + varint_encode((uint64_t)len, p + 1));
+    } else if (len < 0x10000) {
+        p[0] = COMBINE_TYPE(TYPE_LONG_STRING, 2);
+        store_be16(p + 1, (uint16_t)len);
+        buffer_commit(bf, 3);
+    } else {
+        p[0] = COMBINE_TYPE(TYPE_LONG_STRING, 4);
+        store_be32(p + 1, (uint32_t)len);
+        buffer_commit(bf, 5);
+    }
+    buffer_append(bf, str, len);
+}
+
+static inline void append_function(struct buffer *bf, const char *bytecode, int len, int varint) {
+    if (len < MAX_COOKIE) {
+        char *p = buffer_reserve(bf, MAX_COOKIE);
+        p[0] = COMBINE_TYPE(TYPE_FUNCTION, len);
+        memcpy(p + 1, bytecode, len);
+        buffer_commit(bf, 1 + len);
     } else {
-        uint8_t n;
-        if (len < 0x10000) {
-            n = COMBINE_TYPE(TYPE_LONG_STRING, 2);
-            buffer_append(bf, (char*)&n, 1);
-            uint16_t x = (uint16_t)len;
-            CONVERT(x);
-            buffer_append(bf, (char*)&x, 2);
+        buffer_append_char(bf, COMBINE_TYPE(TYPE_FUNCTION, 0));
+        if (varint) {
+            append_varint_integer(bf, len);
         } else {
-            n = COMBINE_TYPE(TYPE_LONG_STRING, 4);
-            buffer_append(bf, (char*)&n, 1);
-            uint32_t x = (uint32_t) len;
-            CONVERT(x);
-            buffer_append(bf, (char*)&x, 4);
+            append_integer(bf, len);
         }
-        buffer_append(bf, str, len);
+        buffer_append(bf, bytecode, len);
     }
 }
 
-static inline void append_function(struct buffer *bf, const char *bytecode, int len) {
-    if (len < MAX_COOKIE) {
-        uint8_t n = COMBINE_TYPE(TYPE_FUNCTION, len);
-        buffer_append(bf, (char*)&n, 1);
-        if (len > 0) {
-            buffer_append(bf, bytecode, len);
+// cseri.profile的统计状态: 数据照常写出但不保留, 按写出的位置计算每个key路径的长度
+#define PROFILE_PATH_MAX 256
+#define PROFILE_TOP_DEFAULT 20
+
+enum {
+    PROFILE_NIL,
+    PROFILE_BOOLEAN,
+    PROFILE_INTEGER,
+    PROFILE_FLOAT,
+    PROFILE_STRING,
+    PROFILE_TABLE,
+    PROFILE_FUNCTION,
+    PROFILE_TYPES
+};
+
+struct profile_path {
+    size_t bytes;       // 这个路径上的值连同key写出的总长度
+    size_t self;        // 减去下一级路径后的长度
+    size_t count;
+};
+
+struct profile {
+    struct buffer bf;
+    size_t flushed;     // 已经丢弃的数据长度
+    int paths;          // 路径 -> 序号表在栈上的位置
+    int names;          // 序号 -> 路径数组在栈上的位置
+    int strings;        // 出现过的字符串表在栈上的位置
+    struct profile_path *entries;
+    int entry_count;
+    int entry_cap;
+    size_t children[MAX_DEPTH + 4];     // 各层table中已写出的子路径长度
+    char path[PROFILE_PATH_MAX];
+    int path_len;
+    size_t types[PROFILE_TYPES];
+    size_t string_count;
+    size_t string_bytes;
+    size_t dup_count;
+    size_t dup_bytes;
+    size_t function_count;  // 写出字节码的函数
+    size_t function_bytes;
+    size_t function_refs;   // 重复出现, 只写了序号的函数
+};
+
+// 序列化状态
+struct packer {
+    struct buffer *bf;
+    int intern;         // 驻留表(字符串 -> 序号)在栈上的位置, 0表示不驻留
+    int intern_count;
+    int shared;         // 引用表(table -> 序号)在栈上的位置, 0表示不记录引用
+    int shared_count;
+    int schema;         // schema字段表数组在栈上的位置, 0表示不使用schema
+    int schema_defined; // 已写出定义的schema序号表在栈上的位置
+    int packed;         // 同类型数组是否紧密排列写出
+    int varint;         // 整数和长度是否用varint写出
+    int functions;      // 函数表(函数 -> 序号)在栈上的位置, 0表示不记录; 写出第一个函数前是nil占位
+    int functions_count;
+    int strip;          // 函数字节码是否去掉调试信息
+    int version;        // 写出的内容要求的数据帧版本
+    struct profile *profile;    // cseri.profile的统计, 平时为NULL
+};
+
+static void packer_init(struct packer *pk, struct buffer *bf) {
+    pk->bf = bf;
+    pk->intern = 0;
+    pk->intern_count = 0;
+    pk->shared = 0;
+    pk->shared_count = 0;
+    pk->schema = 0;
+    pk->schema_defined = 0;
+    pk->packed = 1;
+    pk->varint = 0;
+    pk->functions = 0;
+    pk->functions_count = -1;
+    pk->strip = 0;
+    pk->version = FRAME_VERSION;
+    pk->profile = NULL;
+}
+
+static inline void pack_integer(struct packer *pk, int64_t v) {
+    if (pk->varint) {
+        append_varint_integer(pk->bf, v);
+    } else {
+        append_integer(pk->bf, v);
+    }
+}
+
+// 在数据开头写入驻留标记, 驻留表由调用者创建在index处
+static void packer_intern(struct packer *pk, int index) {
+    buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_INTERN));
+    pk->intern = index;
+    pk->intern_count = 0;
+}
+
+// 写入引用标记, 之后的table按引用表编号, 引用表由调用者创建在index处
+static void packer_shared(struct packer *pk, int index) {
+    buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_SHARED));
+    pk->shared = index;
+    pk->shared_count = 0;
+}
+
+// 重复出现的函数只写一次, 由调用者在index处压入nil占位, 写出第一个函数时才创建函数表并写出标记
+static void packer_functions(struct packer *pk, int index) {
+    pk->functions = index;
+    pk->functions_count = -1;
+}
+
+// 统计字符串, 之前出现过的计入重复
+static void
+profile_string(lua_State *L, struct profile *pf, int index, size_t sz) {
+    pf->string_count++;
+    pf->string_bytes += sz;
+    lua_pushvalue(L, index);
+    lua_rawget(L, pf->strings);
+    int seen = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (seen) {
+        pf->dup_count++;
+        pf->dup_bytes += sz;
+        return;
+    }
+    lua_pushvalue(L, index);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, pf->strings);
+}
+
+static void
+pack_string(lua_State *L, struct packer *pk, int index) {
+    size_t sz = 0;
+    const char *str = lua_tolstring(L, index, &sz);
+    if (pk->profile) {
+        profile_string(L, pk->profile, index, sz);
+    }
+    if (pk->intern == 0 || sz < INTERN_MIN_LEN || sz >= MAX_COOKIE) {
+        append_string(pk->bf, str, (int)sz, pk->varint);
+        return;
+    }
+    lua_pushvalue(L, index);
+    lua_rawget(L, pk->intern);
+    if (lua_isnumber(L, -1)) {
+        buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_STRING_REF));
+        append_varint(pk->bf, (uint64_t)lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    append_string(pk->bf, str, (int)sz, pk->varint);
+    if (pk->intern_count < INTERN_MAX_COUNT) {
+        lua_pushvalue(L, index);
+        lua_pushinteger(L, pk->intern_count++);
+        lua_rawset(L, pk->intern);
+    }
+}
+
+static void pack_one(lua_State *L, struct packer *pk, int index, int depth);
+
+static inline size_t
+profile_pos(struct packer *pk) {
+    return pk->profile->flushed + buffer_size(pk->bf);
+}
+
+// 路径后面接上一段, 超出长度时截断
+static void
+profile_path_push(struct profile *pf, const char *seg, size_t len) {
+    size_t room = PROFILE_PATH_MAX - 1 - pf->path_len;
+    if (len > room)
+        len = room;
+    memcpy(pf->path + pf->path_len, seg, len);
+    pf->path_len += (int)len;
+}
+
+static void
+profile_path_name(struct profile *pf, const char *name, size_t len) {
+    if (pf->path_len > 0)
+        profile_path_push(pf, ".", 1);
+    profile_path_push(pf, name, len);
+}
+
+// 按key接上一段路径: 字符串key写成.name, 整数key写成[], 其他类型写成[类型名]
+static void
+profile_path_key(lua_State *L, struct profile *pf, int key) {
+    int type = lua_type(L, key);
+    if (type == LUA_TSTRING) {
+        size_t len;
+        const char *name = lua_tolstring(L, key, &len);
+        profile_path_name(pf, name, len);
+    } else if (type == LUA_TNUMBER && lua_isinteger(L, key)) {
+        profile_path_push(pf, "[]", 2);
+    } else {
+        const char *name = lua_typename(L, type);
+        profile_path_push(pf, "[", 1);
+        profile_path_push(pf, name, strlen(name));
+        profile_path_push(pf, "]", 1);
+    }
+}
+
+// 把写出的长度累加到当前路径上
+static void
+profile_add(lua_State *L, struct packer *pk, size_t bytes, size_t self) {
+    struct profile *pf = pk->profile;
+    lua_pushlstring(L, pf->path, pf->path_len);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, pf->paths);
+    int id;
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        if (pf->entry_count == pf->entry_cap) {
+            int cap = pf->entry_cap ? pf->entry_cap * 2 : 64;
+            struct profile_path *entries = (struct profile_path *)realloc(pf->entries, cap * sizeof(*entries));
+            if (entries == NULL) {
+                luaL_error(L, "内存分配失败");
+            }
+            pf->entries = entries;
+            pf->entry_cap = cap;
         }
+        id = pf->entry_count++;
+        memset(&pf->entries[id], 0, sizeof(pf->entries[id]));
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, pf->names, id + 1);
+        lua_pushinteger(L, id);
+        lua_rawset(L, pf->paths);
     } else {
-        uint8_t n = COMBINE_TYPE(TYPE_FUNCTION, 0);
-        buffer_append(bf, (char*)&n, 1);
-        append_integer(bf, len);
-        buffer_append(bf, bytecode, len);
+        id = (int)lua_tointeger(L, -1);
+        lua_pop(L, 2);
+    }
+    pf->entries[id].bytes += bytes;
+    pf->entries[id].self += self;
+    pf->entries[id].count++;
+}
+
+// 写出depth层table中的一个值(连同key), 长度记到对应的路径上.
+// key为0时没有key, 路径按name(为NULL时是数组元素)接上
+static void
+profile_child(lua_State *L, struct packer *pk, int key, int value, int depth, const char *name, size_t len) {
+    struct profile *pf = pk->profile;
+    if (key < 0)
+        key = lua_gettop(L) + key + 1;
+    if (value < 0)
+        value = lua_gettop(L) + value + 1;
+    int saved = pf->path_len;
+    size_t start = profile_pos(pk);
+    if (key) {
+        profile_path_key(L, pf, key);
+        pack_one(L, pk, key, depth + 1);
+    } else if (name) {
+        profile_path_name(pf, name, len);
+    } else {
+        profile_path_push(pf, "[]", 2);
     }
+    // 值是table时, 它的子路径长度累加在depth + 2层
+    pf->children[depth + 2] = 0;
+    pack_one(L, pk, value, depth + 1);
+    size_t bytes = profile_pos(pk) - start;
+    pf->children[depth] += bytes;
+    profile_add(L, pk, bytes, bytes - pf->children[depth + 2]);
+    pf->path_len = saved;
 }
 
-static void pack_one(lua_State *L, struct buffer *b, int index, int depth);
+// 依次尝试各个schema, table的key都是某个schema的字段时按该schema写出, 返回0表示没有匹配的schema
+static int
+pack_record(lua_State *L, struct packer *pk, int index, int depth) {
+    int count = (int)lua_rawlen(L, pk->schema);
+    for (int id = 0; id < count; ++id) {
+        lua_rawgeti(L, pk->schema, id + 1);
+        int fields = lua_gettop(L);
+        int n = (int)lua_rawlen(L, fields);
+        luaL_checkstack(L, n + LUA_MINSTACK, NULL);
+        // 字段值按位置放到栈上, 缺少的字段为nil
+        for (int i = 0; i < n; ++i)
+            lua_pushnil(L);
+        int matched = 0;
+        lua_pushnil(L);
+        while (lua_next(L, index) != 0) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, fields);
+            if (lua_type(L, -3) != LUA_TSTRING || !lua_isnumber(L, -1)) {
+                lua_pop(L, 3);
+                matched = -1;
+                break;
+            }
+            int pos = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+            lua_replace(L, fields + pos);
+            matched = 1;
+        }
+        if (matched == 0) {
+            // 空table按普通table写出更短
+            lua_settop(L, fields - 1);
+            return 0;
+        }
+        if (matched < 0) {
+            lua_settop(L, fields - 1);
+            continue;
+        }
+
+        lua_rawgeti(L, pk->schema_defined, id + 1);
+        int defined = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (!defined) {
+            buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_SCHEMA_DEF));
+            append_varint(pk->bf, id);
+            append_varint(pk->bf, n);
+            for (int i = 1; i <= n; ++i) {
+                lua_rawgeti(L, fields, i);
+                pack_string(L, pk, -1);
+                lua_pop(L, 1);
+            }
+            lua_pushboolean(L, 1);
+            lua_rawseti(L, pk->schema_defined, id + 1);
+        }
+        buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_RECORD));
+        append_varint(pk->bf, id);
+        for (int i = 1; i <= n; ++i) {
+            if (pk->profile) {
+                lua_rawgeti(L, fields, i);
+                size_t len;
+                const char *name = lua_tolstring(L, -1, &len);
+                lua_pop(L, 1);
+                profile_child(L, pk, 0, fields + i, depth, name, len);
+            } else {
+                pack_one(L, pk, fields + i, depth + 1);
+            }
+        }
+        lua_settop(L, fields - 1);
+        return 1;
+    }
+    return 0;
+}
 
+// 检查数组部分是否全是整数, 全是浮点数或全是布尔值, 返回元素类型; 否则返回-1.
+// 整数数组中个别很大的值会让定长排列比逐个写出更长, 这时也返回-1
 static int
-append_table_array(lua_State *L, struct buffer *bf, int index, int depth) {
+packed_kind(lua_State *L, int index, int array_size) {
+    lua_rawgeti(L, index, 1);
+    int type = lua_type(L, -1);
+    int integer = type == LUA_TNUMBER && lua_isinteger(L, -1);
+    lua_pop(L, 1);
+    if (type != LUA_TNUMBER && type != LUA_TBOOLEAN) {
+        return -1;
+    }
+    int64_t lo = 0, hi = 0;
+    size_t plain = 0;
+    int single = 1;
+    for (int i = 1; i <= array_size; ++i) {
+        lua_rawgeti(L, index, i);
+        if (lua_type(L, -1) != type) {
+            lua_pop(L, 1);
+            return -1;
+        }
+        if (type == LUA_TNUMBER) {
+            if ((lua_isinteger(L, -1) != 0) != integer) {
+                lua_pop(L, 1);
+                return -1;
+            }
+            if (integer) {
+                int64_t v = lua_tointeger(L, -1);
+                if (v < lo) lo = v;
+                if (v > hi) hi = v;
+                plain += integer_size(v);
+            } else if (single) {
+                double v = lua_tonumber(L, -1);
+                single = v >= -FLT_MAX && v <= FLT_MAX && (double)(float)v == v;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    if (type == LUA_TBOOLEAN)
+        return PACKED_BOOLEAN;
+    if (!integer)
+        return single ? PACKED_FLOAT : PACKED_DOUBLE;
+    int kind;
+    if (lo >= 0) {
+        kind = hi <= UINT8_MAX ? PACKED_UINT8 : hi <= UINT16_MAX ? PACKED_UINT16
+            : hi <= UINT32_MAX ? PACKED_UINT32 : PACKED_INT64;
+    } else {
+        kind = lo >= INT8_MIN && hi <= INT8_MAX ? PACKED_INT8 : lo >= INT16_MIN && hi <= INT16_MAX ? PACKED_INT16
+            : lo >= INT32_MIN && hi <= INT32_MAX ? PACKED_INT32 : PACKED_INT64;
+    }
+    return (size_t)array_size * packed_width[kind] + 2 <= plain ? kind : -1;
+}
+
+// width是常量时展开成定长的小端序写入, 编译器可以向量化
+static inline void
+packed_store(uint8_t *p, const uint64_t *v, int count, int width) {
+    for (int i = 0; i < count; ++i) {
+        for (int b = 0; b < width; ++b) {
+            p[i * width + b] = (uint8_t)(v[i] >> (8 * b));
+        }
+    }
+}
+
+static void
+append_packed(lua_State *L, struct buffer *bf, int index, int array_size, int kind) {
+    uint8_t head[2] = {COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_PACKED), (uint8_t)kind};
+    buffer_append(bf, head, 2);
+    append_varint(bf, (uint64_t)array_size);
+
+    int width = packed_width[kind];
+    uint64_t v[PACKED_BATCH];
+    uint8_t out[PACKED_BATCH * 8];
+    for (int i = 1; i <= array_size; i += PACKED_BATCH) {
+        int count = array_size - i + 1 < PACKED_BATCH ? array_size - i + 1 : PACKED_BATCH;
+        size_t len;
+        if (kind == PACKED_BOOLEAN) {
+            len = (count + 7) / 8;
+            memset(out, 0, len);
+            for (int j = 0; j < count; ++j) {
+                lua_rawgeti(L, index, i + j);
+                out[j >> 3] |= (uint8_t)(lua_toboolean(L, -1) << (j & 7));
+                lua_pop(L, 1);
+            }
+        } else {
+            len = (size_t)count * width;
+            for (int j = 0; j < count; ++j) {
+                lua_rawgeti(L, index, i + j);
+                if (kind == PACKED_FLOAT) {
+                    float f = (float)lua_tonumber(L, -1);
+                    uint32_t u;
+                    memcpy(&u, &f, sizeof(u));
+                    v[j] = u;
+                } else if (kind == PACKED_DOUBLE) {
+                    double d = lua_tonumber(L, -1);
+                    memcpy(&v[j], &d, sizeof(d));
+                } else {
+                    v[j] = (uint64_t)(int64_t)lua_tointeger(L, -1);
+                }
+                lua_pop(L, 1);
+            }
+            switch (width) {
+            case 1: packed_store(out, v, count, 1); break;
+            case 2: packed_store(out, v, count, 2); break;
+            case 4: packed_store(out, v, count, 4); break;
+            default: packed_store(out, v, count, 8); break;
+            }
+        }
+        buffer_append(bf, out, len);
+    }
+}
+
+static int
+append_table_array(lua_State *L, struct packer *pk, int index, int depth) {
+    struct buffer *bf = pk->bf;
     int array_size = lua_rawlen(L,index);
+    if (pk->packed && array_size >= PACKED_MIN_COUNT) {
+        int kind = packed_kind(L, index, array_size);
+        if (kind >= 0) {
+            append_packed(L, bf, index, array_size, kind);
+            if (pk->version < FRAME_VERSION_VARINT)
+                pk->version = FRAME_VERSION_VARINT;
+            if (pk->profile) {
+                int type = kind == PACKED_BOOLEAN ? PROFILE_BOOLEAN
+                    : kind >= PACKED_FLOAT ? PROFILE_FLOAT : PROFILE_INTEGER;
+                pk->profile->types[type] += array_size;
+            }
+            return array_size;
+        }
+    }
     if (array_size >= MAX_COOKIE-1) {
-        uint8_t n = COMBINE_TYPE(TYPE_TABLE, MAX_COOKIE-1);
-        buffer_append(bf, (char*)&n, 1);
-        append_integer(bf, array_size);
+        buffer_append_char(bf, COMBINE_TYPE(TYPE_TABLE, MAX_COOKIE-1));
+        pack_integer(pk, array_size);
     } else {
-        uint8_t n = COMBINE_TYPE(TYPE_TABLE, array_size);
-        buffer_append(bf, (char*)&n, 1);
+        buffer_append_char(bf, COMBINE_TYPE(TYPE_TABLE, array_size));
     }
 
     int i;
     for (i=1;i<=array_size;i++) {
         lua_rawgeti(L,index,i);
-        pack_one(L, bf, -1, depth + 1);
+        if (pk->profile) {
+            profile_child(L, pk, 0, -1, depth, NULL, 0);
+        } else {
+            pack_one(L, pk, -1, depth + 1);
+        }
         lua_pop(L, 1);
     }
 
@@ -172,7 +699,7 @@ append_table_array(lua_State *L, struct buffer *bf, int index, int depth) {
 }
 
 static void
-append_table_hash(lua_State *L, struct buffer *bf, int index, int depth, int array_size) {
+append_table_hash(lua_State *L, struct packer *pk, int index, int depth, int array_size) {
     lua_pushnil(L);
     while (lua_next(L, index) != 0) {
         if (lua_type(L,-2) == LUA_TNUMBER && lua_isinteger(L, -2)) {
@@ -182,21 +709,43 @@ append_table_hash(lua_State *L, struct buffer *bf, int index, int depth, int arr
                 continue;
             }
         }
-        pack_one(L,bf,-2, depth +1);
-        pack_one(L,bf,-1, depth +1);
+        if (pk->profile) {
+            profile_child(L, pk, -2, -1, depth, NULL, 0);
+        } else {
+            pack_one(L,pk,-2, depth +1);
+            pack_one(L,pk,-1, depth +1);
+        }
         lua_pop(L, 1);
     }
-    append_nil(bf);
+    append_nil(pk->bf);
 }
 
 static void
-pack_table(lua_State *L, struct buffer *bf, int index, int depth) {
+pack_table(lua_State *L, struct packer *pk, int index, int depth) {
     luaL_checkstack(L, LUA_MINSTACK, NULL);
     if (index < 0) {
         index = lua_gettop(L) + index + 1;
     }
-    int array_size = append_table_array(L, bf, index, depth);
-    append_table_hash(L, bf, index, depth, array_size);
+    if (pk->shared) {
+        lua_pushvalue(L, index);
+        lua_rawget(L, pk->shared);
+        if (lua_isnumber(L, -1)) {
+            buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_TABLE_REF));
+            append_varint(pk->bf, (uint64_t)lua_tointeger(L, -1));
+            lua_pop(L, 1);
+            return;
+        }
+        lua_pop(L, 1);
+        // 先登记再序列化内容, 内容中的循环引用会写成序号
+        lua_pushvalue(L, index);
+        lua_pushinteger(L, pk->shared_count++);
+        lua_rawset(L, pk->shared);
+    }
+    if (pk->schema && pack_record(L, pk, index, depth)) {
+        return;
+    }
+    int array_size = append_table_array(L, pk, index, depth);
+    append_table_hash(L, pk, index, depth, array_size);
 }
 
 static int writer_lua_dump(lua_State *L, const void* p, size_t sz, void* ud) {
@@ -205,56 +754,110 @@ static int writer_lua_dump(lua_State *L, const void* p, size_t sz, void* ud) {
     return 0;
 }
 
+// 函数 -> 字节码字符串的弱键表, 每个lua_State按是否去掉调试信息各一张, 字节码只在函数第一次写出时dump
+static char function_cache_key[2];
+
+static void
+push_function_cache(lua_State *L, int strip) {
+    void *key = &function_cache_key[strip ? 1 : 0];
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_istable(L, -1))
+        return;
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// 把index处函数的字节码作为字符串压入栈顶
 static void
-pack_function(lua_State *L, struct buffer *bf, int index, int depth) {
+dump_function(lua_State *L, struct packer *pk, int index) {
     struct buffer func_bf;
     buffer_initialize(&func_bf, L);
-
     lua_pushvalue(L, index);
-
-    if (lua_dump(L, writer_lua_dump, &func_bf, 0) != 0) {
+#if LUA_VERSION_NUM < 503
+    int err = lua_dump(L, writer_lua_dump, &func_bf);
+#else
+    int err = lua_dump(L, writer_lua_dump, &func_bf, pk->strip);
+#endif
+    lua_pop(L, 1);
+    if (err != 0 || buffer_size(&func_bf) == 0) {
         buffer_free(&func_bf);
-        buffer_free(bf);
-        luaL_error(L, "函数编译失败");
+        buffer_free(pk->bf);
+        luaL_error(L, err != 0 ? "函数编译失败" : "函数字节码为空");
     }
+    buffer_push_string(&func_bf);
+    buffer_free(&func_bf);
+}
 
-    size_t sz = buffer_size(&func_bf);
-    if (sz == 0) {
-        buffer_free(&func_bf);
-        lua_pop(L, 1);
-        luaL_error(L, "函数字节码为空");
+static void
+pack_function(lua_State *L, struct packer *pk, int index) {
+    if (pk->functions) {
+        if (pk->functions_count < 0) {
+            lua_newtable(L);
+            lua_replace(L, pk->functions);
+            buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_FUNCTIONS));
+            pk->functions_count = 0;
+            pk->version = FRAME_VERSION_FUNCTIONS;
+        } else {
+            lua_pushvalue(L, index);
+            lua_rawget(L, pk->functions);
+            if (lua_isnumber(L, -1)) {
+                buffer_append_char(pk->bf, COMBINE_TYPE(TYPE_USERDATA, TYPE_EXT_FUNCTION_REF));
+                append_varint(pk->bf, (uint64_t)lua_tointeger(L, -1));
+                lua_pop(L, 1);
+                if (pk->profile) {
+                    pk->profile->function_refs++;
+                }
+                return;
+            }
+            lua_pop(L, 1);
+        }
+        lua_pushvalue(L, index);
+        lua_pushinteger(L, pk->functions_count++);
+        lua_rawset(L, pk->functions);
     }
 
-    char *bytecode = (char*)malloc(sz);
-    if (!bytecode) {
-        buffer_free(&func_bf);
-        buffer_free(bf);
+    push_function_cache(L, pk->strip);
+    lua_pushvalue(L, index);
+    lua_rawget(L, -2);
+    if (lua_type(L, -1) != LUA_TSTRING) {
         lua_pop(L, 1);
-        luaL_error(L, "内存分配失败");
+        dump_function(L, pk, index);
+        lua_pushvalue(L, index);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
     }
-
-    struct block *p = func_bf.head;
-    size_t pos = 0;
-    while (p) {
-        memcpy(bytecode + pos, p->data, p->p);
-        pos += p->p;
-        p = p->next;
+    size_t sz;
+    const char *bytecode = lua_tolstring(L, -1, &sz);
+    append_function(pk->bf, bytecode, (int)sz, pk->varint);
+    lua_pop(L, 2);
+    if (pk->profile) {
+        pk->profile->function_count++;
+        pk->profile->function_bytes += sz;
     }
-
-    append_function(bf, bytecode, sz);
-
-    buffer_free(&func_bf);
-    free(bytecode);
-    lua_pop(L, 1);
 }
 
 static void
-pack_one(lua_State *L, struct buffer *b, int index, int depth) {
+pack_one(lua_State *L, struct packer *pk, int index, int depth) {
+    struct buffer *b = pk->bf;
     if (depth > MAX_DEPTH) {
         buffer_free(b);
         luaL_error(L, "serialize can't pack too depth table");
     }
     int type = lua_type(L,index);
+    if (pk->profile) {
+        int t = type == LUA_TNIL ? PROFILE_NIL : type == LUA_TBOOLEAN ? PROFILE_BOOLEAN
+            : type == LUA_TNUMBER ? (lua_isinteger(L, index) ? PROFILE_INTEGER : PROFILE_FLOAT)
+            : type == LUA_TSTRING ? PROFILE_STRING : type == LUA_TTABLE ? PROFILE_TABLE : PROFILE_FUNCTION;
+        pk->profile->types[t]++;
+    }
     switch(type) {
     case LUA_TNIL:
         append_nil(b);
@@ -262,7 +865,7 @@ pack_one(lua_State *L, struct buffer *b, int index, int depth) {
     case LUA_TNUMBER: {
         if (lua_isinteger(L, index)) {
             lua_Integer x = lua_tointeger(L,index);
-            append_integer(b, x);
+            pack_integer(pk, x);
         } else {
             lua_Number n = lua_tonumber(L,index);
             append_real(b,n);
@@ -272,24 +875,21 @@ pack_one(lua_State *L, struct buffer *b, int index, int depth) {
     case LUA_TBOOLEAN:
         append_boolean(b, lua_toboolean(L,index));
         break;
-    case LUA_TSTRING: {
-        size_t sz = 0;
-        const char *str = lua_tolstring(L,index,&sz);
-        append_string(b, str, (int)sz);
+    case LUA_TSTRING:
+        pack_string(L, pk, index);
         break;
-    }
     case LUA_TTABLE: {
         if (index < 0) {
             index = lua_gettop(L) + index + 1;
         }
-        pack_table(L, b, index, depth+1);
+        pack_table(L, pk, index, depth+1);
         break;
     }
     case LUA_TFUNCTION: {
         if (index < 0) {
             index = lua_gettop(L) + index + 1;
         }
-        pack_function(L, b, index, depth+1);
+        pack_function(L, pk, index);
         break;
     }
     default:
@@ -298,139 +898,293 @@ pack_one(lua_State *L, struct buffer *b, int index, int depth) {
     }
 }
 
-static char *buffer_to_string(struct buffer *b, size_t *size) {
-    *size = buffer_size(b);
-    void *ud;
-    lua_Alloc alloc = lua_getallocf(b->L, &ud);
-    char *str = (char *)alloc(ud, NULL, 0, *size);
-    if (!str) return NULL;
-    char *s = str;
-    struct block *p = b->head;
-    while (p) {
-        memcpy(s, p->data, p->p);
-        s += p->p;
-        p = p->next;
-    }
-    return str;
-}
-
 int to_bin(lua_State *L) {
     int arg_top = lua_gettop(L);
-    int compression_level = 1; // 默认压缩级别为1
-    const char *compression_type = "snappy"; // 默认使用Snappy压缩
+    struct options opt;
+    options_default(&opt);
 
-    // 判断是否传入了压缩级别和压缩方式
-    if (lua_type(L, arg_top) == LUA_TNUMBER) {
-        compression_level = lua_tointeger(L, arg_top);
-        --arg_top;
-    }
-    if (lua_type(L, arg_top) == LUA_TSTRING) {
-        compression_type = lua_tostring(L, arg_top);
+    struct options *popt = options_test(L, arg_top);
+    if (popt) {
+        // 传入了cseri.options创建的选项
+        opt = *popt;
         --arg_top;
-    } else if (lua_type(L, arg_top) == LUA_TBOOLEAN) {
-        // 如果传入了false,则不压缩
-        if (!lua_toboolean(L, arg_top)) {
-            compression_type = "none";
+    } else {
+        // 判断是否传入了压缩级别和压缩方式
+        if (lua_type(L, arg_top) == LUA_TNUMBER) {
+            opt.level = lua_tointeger(L, arg_top);
+            --arg_top;
         }
-        --arg_top;
+        if (lua_type(L, arg_top) == LUA_TSTRING) {
+            const char *compression_type = lua_tostring(L, arg_top);
+            opt.codec = codec_from_name(compression_type);
+            if (opt.codec < 0) {
+                return luaL_error(L, "未知的压缩类型: %s", compression_type);
+            }
+            --arg_top;
+        } else if (lua_type(L, arg_top) == LUA_TBOOLEAN) {
+            // 如果传入了false,则不压缩
+            if (!lua_toboolean(L, arg_top)) {
+                opt.codec = CODEC_NONE;
+            }
+            --arg_top;
+        }
+        codec_check_level(L, opt.codec, opt.level);
     }
 
     struct buffer bf;
-    buffer_initialize(&bf, L);
+    buffer_initialize_pooled(&bf, L);
+    struct packer pk;
+    packer_init(&pk, &bf);
+    pk.packed = opt.packed;
+    pk.varint = opt.varint;
+    pk.strip = opt.strip;
+    pk.version = opt.varint ? FRAME_VERSION_VARINT : FRAME_VERSION;
+    if (arg_top > 0) {
+        lua_pushnil(L);
+        packer_functions(&pk, lua_gettop(L));
+    }
+    if (opt.intern && arg_top > 0) {
+        lua_newtable(L);
+        packer_intern(&pk, lua_gettop(L));
+    }
+    if (opt.shared && arg_top > 0) {
+        lua_newtable(L);
+        packer_shared(&pk, lua_gettop(L));
+    }
+    if (opt.schema_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, opt.schema_ref);
+        pk.schema = lua_gettop(L);
+        lua_newtable(L);
+        pk.schema_defined = lua_gettop(L);
+    }
 
+    int timed = stats_enabled();
+    uint64_t t0 = timed ? stats_now() : 0;
     for (int i = 1; i <= arg_top; ++i) {
-        pack_one(L, &bf, i, 0);
+        pack_one(L, &pk, i, 0);
     }
+    uint64_t t1 = timed ? stats_now() : 0;
+
+    // 数据块链直接送入压缩器, 压缩结果连同帧头写入luaL_Buffer
+    size_t raw = buffer_size(&bf);
+    int blocks = bf.blocks;
+    luaL_Buffer out;
+    luaL_buffinit(L, &out);
+    codec_encode(&bf, &opt, pk.version, &out);
+    buffer_free(&bf);
+    luaL_pushresult(&out);
+
+    if (timed) {
+        stats_add(opt.codec, STATS_COMPRESS_NS, stats_now() - t1);
+        stats_add(opt.codec, STATS_TRAVERSE_NS, t1 - t0);
+        stats_add(opt.codec, STATS_ENCODE_CALLS, 1);
+        stats_add(opt.codec, STATS_ENCODE_RAW, raw);
+        stats_add(opt.codec, STATS_ENCODE_COMPRESSED, lua_rawlen(L, -1));
+        stats_add(opt.codec, STATS_BLOCKS, blocks);
+    }
+    return 1;
+}
 
-    size_t uncompressed_size;
-    char *uncompressed_data = buffer_to_string(&bf, &uncompressed_size);
-    if (!uncompressed_data) {
-        buffer_free(&bf);
-        return luaL_error(L, "内存分配失败");
+// cseri.train_dict(samples[, size]) 用一组样本训练压缩字典. 样本是字符串时原样使用,
+// 其他值先序列化(不带帧头), 与tobin实际压缩的内容一致
+int cseri_train_dict(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_Integer capacity = luaL_optinteger(L, 2, DICT_DEFAULT_SIZE);
+    if (capacity <= 0) {
+        return luaL_error(L, "字典长度必须大于0");
+    }
+    int count = (int)lua_rawlen(L, 1);
+    if (count == 0) {
+        return luaL_error(L, "没有训练样本");
     }
+    lua_settop(L, 2);
+    size_t *sizes = (size_t *)lua_newuserdata(L, count * sizeof(size_t));
+
+    struct buffer bf;
+    buffer_initialize(&bf, L);
+    struct packer pk;
+    packer_init(&pk, &bf);
+    for (int i = 1; i <= count; ++i) {
+        lua_rawgeti(L, 1, i);
+        size_t size = buffer_size(&bf);
+        if (lua_type(L, -1) == LUA_TSTRING) {
+            size_t len;
+            const char *str = lua_tolstring(L, -1, &len);
+            buffer_append(&bf, str, len);
+        } else {
+            pack_one(L, &pk, -1, 0);
+        }
+        sizes[i - 1] = buffer_size(&bf) - size;
+        lua_pop(L, 1);
+    }
+    buffer_push_string(&bf);
+    buffer_free(&bf);
+
+    dict_train(L, lua_tostring(L, -1), sizes, count, (size_t)capacity);
+    return 1;
+}
+
+#define PROFILE_META "cseri.profile"
+
+// 不压缩时数据攒够一段就丢弃, 只记录长度
+static void profile_flush_buffer(struct buffer *bf) {
+    struct profile *pf = (struct profile *)bf->ud;
+    pf->flushed += buffer_size(bf);
+}
+
+static int profile_gc(lua_State *L) {
+    struct profile *pf = (struct profile *)lua_touserdata(L, 1);
+    pf->bf.L = L;
+    buffer_free(&pf->bf);
+    free(pf->entries);
+    pf->entries = NULL;
+    return 0;
+}
 
-    if (strcasecmp(compression_type, "snappy") == 0) {
-        // Google Snappy
-        size_t max_compressed_size = snappy_max_compressed_length(uncompressed_size);
-        char *compressed_data = (char *)malloc(max_compressed_size);
-        if (compressed_data == NULL) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            return luaL_error(L, "内存分配失败");
-        }
-        size_t compressed_size = max_compressed_size;
-        snappy_status res = snappy_compress(uncompressed_data, uncompressed_size, compressed_data, &compressed_size);
-        if (res != SNAPPY_OK) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            free(compressed_data);
-            return luaL_error(L, "Snappy压缩失败");
-        }
-
-        lua_pushlstring(L, compressed_data, compressed_size);
-        free(compressed_data);
-    } else if (strcasecmp(compression_type, "zlib") == 0) {
-        // Zlib
-        if (compression_level < Z_BEST_SPEED || compression_level > Z_BEST_COMPRESSION) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            return luaL_error(L, "Zlib压缩级别最低为%d, 最高为%d", Z_BEST_SPEED, Z_BEST_COMPRESSION);
-        }
-        uLongf compressed_size = compressBound(uncompressed_size);
-        char *compressed_data = (char *)malloc(compressed_size);
-        if (compressed_data == NULL) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            return luaL_error(L, "内存分配失败");
-        }
-        int res = compress2((Bytef *)compressed_data, &compressed_size, (Bytef *)uncompressed_data, uncompressed_size, compression_level);
-        if (res != Z_OK) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            free(compressed_data);
-            return luaL_error(L, "Zlib压缩失败");
-        }
-
-        lua_pushlstring(L, compressed_data, compressed_size);
-        free(compressed_data);
-    } else if (strcasecmp(compression_type, "zstd") == 0) {
-        // Zstd
-        int zstd_min_level = ZSTD_minCLevel();
-        int zstd_max_level = ZSTD_maxCLevel();
-        if (compression_level < zstd_min_level || compression_level > zstd_max_level) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            return luaL_error(L, "Zstd压缩级别最低为%d, 最高为%d", zstd_min_level, zstd_max_level);
-        }
-        size_t compressed_size = ZSTD_compressBound(uncompressed_size);
-        char *compressed_data = (char *)malloc(compressed_size);
-        if (compressed_data == NULL) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            return luaL_error(L, "内存分配失败");
-        }
-        size_t res = ZSTD_compress(compressed_data, compressed_size, uncompressed_data, uncompressed_size, compression_level);
-        if (ZSTD_isError(res)) {
-            buffer_free(&bf);
-            free(uncompressed_data);
-            free(compressed_data);
-            return luaL_error(L, "Zstd压缩失败: %s", ZSTD_getErrorName(res));
-        }
-        compressed_size = res;
-        lua_pushlstring(L, compressed_data, compressed_size);
-        free(compressed_data);
-    } else if (strcasecmp(compression_type, "none") == 0 || strcasecmp(compression_type, "no") == 0) {
-        // 不压缩
-        lua_pushlstring(L, uncompressed_data, uncompressed_size);
+static int profile_compare(const void *a, const void *b) {
+    const struct profile_path *x = *(const struct profile_path * const *)a;
+    const struct profile_path *y = *(const struct profile_path * const *)b;
+    if (x->bytes != y->bytes)
+        return x->bytes < y->bytes ? 1 : -1;
+    return x < y ? -1 : x > y;
+}
+
+static void profile_setfield(lua_State *L, const char *name, size_t v) {
+    lua_pushinteger(L, (lua_Integer)v);
+    lua_setfield(L, -2, name);
+}
+
+// cseri.profile(t[, codec[, top]]) 按tobin的方式遍历t, 统计每个key路径写出的长度.
+// codec可以是压缩方式名或cseri.options创建的选项; 返回
+// {bytes, compressed, paths = {{path, bytes, self, count}, ...}, types, strings, functions},
+// paths按bytes从大到小只保留前top个(默认20). 压缩后的长度无法分到各路径, 路径统计的都是压缩前的长度.
+// 路径中字符串key写成.name, 数组元素和整数key写成[], 其他类型的key写成[类型名].
+// 不压缩时不保留序列化结果; 指定了压缩方式时和tobin一样压缩全部数据, compressed与tobin结果的长度相同
+int cseri_profile(lua_State *L) {
+    luaL_checkany(L, 1);
+    struct options opt;
+    options_default(&opt);
+    struct options *popt = options_test(L, 2);
+    if (popt) {
+        opt = *popt;
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        const char *compression_type = lua_tostring(L, 2);
+        opt.codec = codec_from_name(compression_type);
+        if (opt.codec < 0) {
+            return luaL_error(L, "未知的压缩类型: %s", compression_type);
+        }
+    } else if (lua_isnoneornil(L, 2) || (lua_type(L, 2) == LUA_TBOOLEAN && !lua_toboolean(L, 2))) {
+        opt.codec = CODEC_NONE;
     } else {
-        buffer_free(&bf);
-        free(uncompressed_data);
-        return luaL_error(L, "未知的压缩类型: %s", compression_type);
+        return luaL_argerror(L, 2, "需要压缩方式名或cseri.options");
+    }
+    lua_Integer top = luaL_optinteger(L, 3, PROFILE_TOP_DEFAULT);
+    if (top < 0) {
+        return luaL_error(L, "top不能小于0");
+    }
+    lua_settop(L, 3);
+
+    struct profile *pf = (struct profile *)lua_newuserdata(L, sizeof(*pf));
+    memset(pf, 0, sizeof(*pf));
+    buffer_initialize(&pf->bf, L);
+    if (opt.codec == CODEC_NONE) {
+        pf->bf.flush = profile_flush_buffer;
+        pf->bf.ud = pf;
+    }
+    if (luaL_newmetatable(L, PROFILE_META)) {
+        lua_pushcfunction(L, profile_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_newtable(L);
+    pf->paths = lua_gettop(L);
+    lua_newtable(L);
+    pf->names = lua_gettop(L);
+    lua_newtable(L);
+    pf->strings = lua_gettop(L);
+
+    struct packer pk;
+    packer_init(&pk, &pf->bf);
+    pk.packed = opt.packed;
+    pk.varint = opt.varint;
+    pk.strip = opt.strip;
+    pk.profile = pf;
+    lua_pushnil(L);
+    packer_functions(&pk, lua_gettop(L));
+    if (opt.intern) {
+        lua_newtable(L);
+        packer_intern(&pk, lua_gettop(L));
+    }
+    if (opt.shared) {
+        lua_newtable(L);
+        packer_shared(&pk, lua_gettop(L));
+    }
+    if (opt.schema_ref != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, opt.schema_ref);
+        pk.schema = lua_gettop(L);
+        lua_newtable(L);
+        pk.schema_defined = lua_gettop(L);
     }
 
-    buffer_free(&bf);
-    free(uncompressed_data);
+    pack_one(L, &pk, 1, 0);
+    size_t bytes = profile_pos(&pk);
+    size_t compressed = 0;
+    if (opt.codec != CODEC_NONE) {
+        // 和tobin走同一条压缩路径, 结果含帧头
+        luaL_Buffer out;
+        luaL_buffinit(L, &out);
+        codec_encode(&pf->bf, &opt, pk.version, &out);
+        luaL_pushresult(&out);
+        compressed = lua_rawlen(L, -1);
+        lua_pop(L, 1);
+        buffer_free(&pf->bf);
+    }
 
+    lua_createtable(L, 0, 6);
+    profile_setfield(L, "bytes", bytes);
+    if (opt.codec != CODEC_NONE) {
+        profile_setfield(L, "compressed", compressed);
+    }
+
+    // 按长度排序, 相同时保持出现顺序
+    struct profile_path **order = (struct profile_path **)lua_newuserdata(L, pf->entry_count * sizeof(*order) + 1);
+    for (int i = 0; i < pf->entry_count; ++i)
+        order[i] = &pf->entries[i];
+    qsort(order, pf->entry_count, sizeof(*order), profile_compare);
+    int n = pf->entry_count < top ? pf->entry_count : (int)top;
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; ++i) {
+        lua_createtable(L, 0, 4);
+        lua_rawgeti(L, pf->names, (int)(order[i] - pf->entries) + 1);
+        lua_setfield(L, -2, "path");
+        profile_setfield(L, "bytes", order[i]->bytes);
+        profile_setfield(L, "self", order[i]->self);
+        profile_setfield(L, "count", order[i]->count);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -3, "paths");
+    lua_pop(L, 1);
+
+    static const char *type_names[PROFILE_TYPES] = {
+        "nil", "boolean", "integer", "float", "string", "table", "function"
+    };
+    lua_createtable(L, 0, PROFILE_TYPES);
+    for (int i = 0; i < PROFILE_TYPES; ++i)
+        profile_setfield(L, type_names[i], pf->types[i]);
+    lua_setfield(L, -2, "types");
+
+    lua_createtable(L, 0, 4);
+    profile_setfield(L, "count", pf->string_count);
+    profile_setfield(L, "bytes", pf->string_bytes);
+    profile_setfield(L, "duplicate_count", pf->dup_count);
+    profile_setfield(L, "duplicate_bytes", pf->dup_bytes);
+    lua_setfield(L, -2, "strings");
+
+    lua_createtable(L, 0, 3);
+    profile_setfield(L, "count", pf->function_count);
+    profile_setfield(L, "bytecode_bytes", pf->function_bytes);
+    profile_setfield(L, "refs", pf->function_refs);
+    lua_setfield(L, -2, "functions");
     return 1;
 }
 
@@ -438,16 +1192,45 @@ struct reader {
     const char *buffer;
     int len;
     int ptr;
+    // 剩余数据不足size字节时调用, 为NULL表示数据已全部在buffer中
+    int (*fill)(struct reader *rd, int size);
+    void *ud;
+    int intern;         // 驻留表在栈上的位置, 数据中出现驻留标记时在这里创建
+    int intern_count;   // 为-1时表示没有开启驻留
+    int intern_new;     // 读取期间新建了驻留表
+    int shared;         // 引用表在栈上的位置, 用法同驻留表
+    int shared_count;
+    int shared_new;
+    int schema;         // schema字段表数组在栈上的位置, 遇到第一个schema定义时创建
+    int schema_new;
+    int functions;      // 函数表在栈上的位置, 用法同驻留表
+    int functions_count;
+    int functions_new;
+    int cache_functions;    // 相同字节码的函数从缓存中取出, 不再重复加载
 };
 
 static void reader_init(struct reader *rd, const char *buffer, int size) {
     rd->buffer = buffer;
     rd->len = size;
     rd->ptr = 0;
+    rd->fill = NULL;
+    rd->ud = NULL;
+    rd->intern = 0;
+    rd->intern_count = -1;
+    rd->intern_new = 0;
+    rd->shared = 0;
+    rd->shared_count = -1;
+    rd->shared_new = 0;
+    rd->schema = 0;
+    rd->schema_new = 0;
+    rd->functions = 0;
+    rd->functions_count = -1;
+    rd->functions_new = 0;
+    rd->cache_functions = 0;
 }
 
 static const void *reader_read(struct reader *rd, int size) {
-    if (rd->len < size)
+    if (rd->len < size && (rd->fill == NULL || !rd->fill(rd, size)))
         return NULL;
 
     int ptr = rd->ptr;
@@ -463,6 +1246,41 @@ invalid_stream_line(lua_State *L, struct reader *rd, int line) {
 
 #define invalid_stream(L,rd) invalid_stream_line(L,rd,__LINE__)
 
+// 剩余数据足够长时直接在缓冲区中解码, 常见的1~2字节先单独判断; 否则逐字节读取
+static uint64_t
+get_varint(lua_State *L, struct reader *rd) {
+    if (rd->len >= MAX_VARINT_SIZE) {
+        const uint8_t *p = (const uint8_t *)rd->buffer + rd->ptr;
+        uint64_t v = p[0];
+        int n = 1;
+        if (v >= 0x80) {
+            v = (v & 0x7f) | (uint64_t)p[1] << 7;
+            n = 2;
+            if (p[1] >= 0x80) {
+                n = varint_decode(p, MAX_VARINT_SIZE, &v);
+                if (n == 0) {
+                    invalid_stream(L, rd);
+                }
+            }
+        }
+        rd->ptr += n;
+        rd->len -= n;
+        return v;
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < MAX_VARINT_SIZE; ++i) {
+        const uint8_t *p = reader_read(rd, 1);
+        if (p == NULL) {
+            invalid_stream(L, rd);
+        }
+        v |= (uint64_t)(*p & 0x7f) << (7 * i);
+        if (!(*p & 0x80))
+            return v;
+    }
+    invalid_stream(L, rd);
+    return 0;
+}
+
 static int64_t
 get_integer(lua_State *L, struct reader *rd, int cookie) {
     switch (cookie) {
@@ -481,17 +1299,19 @@ get_integer(lua_State *L, struct reader *rd, int cookie) {
         const uint16_t *pn = reader_read(rd, sizeof(n));
         if (pn == NULL)
             invalid_stream(L,rd);
-        memcpy(&n, pn, sizeof(n));
-        CONVERT(n);
+        n = load_be16(pn);
         return n;
     }
+    case TYPE_NUMBER_VARINT: {
+        uint64_t zz = get_varint(L, rd);
+        return (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+    }
     case TYPE_NUMBER_DWORD: {
         int32_t n = 0;
         const int32_t *pn = reader_read(rd, sizeof(n));
         if (pn == NULL)
             invalid_stream(L,rd);
-        memcpy(&n, pn, sizeof(n));
-        CONVERT(n);
+        n = (int32_t)load_be32(pn);
         return n;
     }
     case TYPE_NUMBER_QWORD: {
@@ -499,8 +1319,7 @@ get_integer(lua_State *L, struct reader *rd, int cookie) {
         const int64_t *pn = reader_read(rd, sizeof(n));
         if (pn == NULL)
             invalid_stream(L,rd);
-        memcpy(&n, pn, sizeof(n));
-        CONVERT(n);
+        n = (int64_t)load_be64(pn);
         return n;
     }
     default:
@@ -528,8 +1347,236 @@ get_buffer(lua_State *L, struct reader *rd, int len) {
     lua_pushlstring(L, p, len);
 }
 
+static void
+get_short_string(lua_State *L, struct reader *rd, int len) {
+    get_buffer(L, rd, len);
+    if (rd->intern_count >= 0 && len >= INTERN_MIN_LEN && rd->intern_count < INTERN_MAX_COUNT) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, rd->intern, ++rd->intern_count);
+    }
+}
+
 static void unpack_one(lua_State *L, struct reader *rd);
 
+static void
+unpack_schema(lua_State *L, struct reader *rd) {
+    uint64_t id = get_varint(L, rd);
+    uint64_t n = get_varint(L, rd);
+    if (rd->schema == 0 || id >= SCHEMA_MAX_FIELDS || n == 0 || n > SCHEMA_MAX_FIELDS) {
+        invalid_stream(L, rd);
+    }
+    if (lua_isnil(L, rd->schema)) {
+        lua_newtable(L);
+        lua_replace(L, rd->schema);
+        rd->schema_new = 1;
+    }
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    lua_createtable(L, (int)n, 0);
+    for (int i = 1; i <= (int)n; ++i) {
+        unpack_one(L, rd);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            invalid_stream(L, rd);
+        }
+        lua_rawseti(L, -2, i);
+    }
+    lua_rawseti(L, rd->schema, (int)id + 1);
+    // 定义之后紧跟使用它的记录
+    unpack_one(L, rd);
+}
+
+static void
+unpack_record(lua_State *L, struct reader *rd) {
+    uint64_t id = get_varint(L, rd);
+    if (rd->schema == 0 || id >= SCHEMA_MAX_FIELDS || lua_isnil(L, rd->schema)) {
+        invalid_stream(L, rd);
+    }
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    lua_rawgeti(L, rd->schema, (int)id + 1);
+    if (!lua_istable(L, -1)) {
+        invalid_stream(L, rd);
+    }
+    int fields = lua_gettop(L);
+    int n = (int)lua_rawlen(L, fields);
+    lua_createtable(L, 0, n);
+    if (rd->shared_count >= 0) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, rd->shared, ++rd->shared_count);
+    }
+    for (int i = 1; i <= n; ++i) {
+        lua_rawgeti(L, fields, i);
+        unpack_one(L, rd);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 2);
+        } else {
+            lua_rawset(L, -3);
+        }
+    }
+    lua_remove(L, fields);
+}
+
+static void
+push_int64(lua_State *L, int64_t n) {
+    if (sizeof(lua_Integer) < sizeof(int64_t) && llabs(n) > MAX_LUA_INTEGER) {
+        lua_pushnumber(L, (lua_Number)n);
+    } else {
+        lua_pushinteger(L, (lua_Integer)n);
+    }
+}
+
+static inline void
+packed_load(const uint8_t *p, uint64_t *v, int count, int width) {
+    for (int i = 0; i < count; ++i) {
+        uint64_t x = 0;
+        for (int b = 0; b < width; ++b) {
+            x |= (uint64_t)p[i * width + b] << (8 * b);
+        }
+        v[i] = x;
+    }
+}
+
+static void unpack_hash(lua_State *L, struct reader *rd);
+
+static void
+unpack_packed(lua_State *L, struct reader *rd) {
+    const uint8_t *pk = reader_read(rd, 1);
+    if (pk == NULL || *pk > PACKED_DOUBLE) {
+        invalid_stream(L, rd);
+    }
+    int kind = *pk;
+    int width = packed_width[kind];
+    uint64_t size = get_varint(L, rd);
+    // 数据已全部在内存中时先检查长度, 避免按错误的长度创建巨大的table
+    uint64_t need = kind == PACKED_BOOLEAN ? (size + 7) / 8 : size * width;
+    if (size > INT_MAX || (rd->fill == NULL && need > (uint64_t)rd->len)) {
+        invalid_stream(L, rd);
+    }
+    int array_size = (int)size;
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    lua_createtable(L, array_size, 0);
+    if (rd->shared_count >= 0) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, rd->shared, ++rd->shared_count);
+    }
+
+    uint64_t v[PACKED_BATCH];
+    for (int i = 1; i <= array_size; i += PACKED_BATCH) {
+        int count = array_size - i + 1 < PACKED_BATCH ? array_size - i + 1 : PACKED_BATCH;
+        const uint8_t *p = reader_read(rd, kind == PACKED_BOOLEAN ? (count + 7) / 8 : count * width);
+        if (p == NULL) {
+            invalid_stream(L, rd);
+        }
+        switch (kind) {
+        case PACKED_BOOLEAN:
+            for (int j = 0; j < count; ++j) {
+                lua_pushboolean(L, (p[j >> 3] >> (j & 7)) & 1);
+                lua_rawseti(L, -2, i + j);
+            }
+            continue;
+        case PACKED_INT8: case PACKED_UINT8: packed_load(p, v, count, 1); break;
+        case PACKED_INT16: case PACKED_UINT16: packed_load(p, v, count, 2); break;
+        case PACKED_INT32: case PACKED_UINT32: case PACKED_FLOAT: packed_load(p, v, count, 4); break;
+        default: packed_load(p, v, count, 8); break;
+        }
+        for (int j = 0; j < count; ++j) {
+            switch (kind) {
+            case PACKED_INT8: lua_pushinteger(L, (int8_t)v[j]); break;
+            case PACKED_INT16: lua_pushinteger(L, (int16_t)v[j]); break;
+            case PACKED_INT32: lua_pushinteger(L, (int32_t)v[j]); break;
+            case PACKED_INT64: push_int64(L, (int64_t)v[j]); break;
+            case PACKED_FLOAT: {
+                uint32_t u = (uint32_t)v[j];
+                float f;
+                memcpy(&f, &u, sizeof(f));
+                lua_pushnumber(L, f);
+                break;
+            }
+            case PACKED_DOUBLE: {
+                double d;
+                memcpy(&d, &v[j], sizeof(d));
+                lua_pushnumber(L, d);
+                break;
+            }
+            default: lua_pushinteger(L, (lua_Integer)v[j]); break;
+            }
+            lua_rawseti(L, -2, i + j);
+        }
+    }
+    unpack_hash(L, rd);
+}
+
+static void
+push_ext(lua_State *L, struct reader *rd, int cookie) {
+    switch (cookie) {
+    case TYPE_EXT_INTERN:
+        if (rd->intern == 0) {
+            invalid_stream(L, rd);
+        }
+        // 驻留标记不是一个值, 新建驻留表后接着读取后面的值
+        lua_newtable(L);
+        lua_replace(L, rd->intern);
+        rd->intern_count = 0;
+        rd->intern_new = 1;
+        unpack_one(L, rd);
+        break;
+    case TYPE_EXT_STRING_REF: {
+        uint64_t i = get_varint(L, rd);
+        if (rd->intern_count < 0 || i >= (uint64_t)rd->intern_count) {
+            invalid_stream(L, rd);
+        }
+        lua_rawgeti(L, rd->intern, (int)i + 1);
+        break;
+    }
+    case TYPE_EXT_SHARED:
+        if (rd->shared == 0) {
+            invalid_stream(L, rd);
+        }
+        lua_newtable(L);
+        lua_replace(L, rd->shared);
+        rd->shared_count = 0;
+        rd->shared_new = 1;
+        unpack_one(L, rd);
+        break;
+    case TYPE_EXT_TABLE_REF: {
+        uint64_t i = get_varint(L, rd);
+        if (rd->shared_count < 0 || i >= (uint64_t)rd->shared_count) {
+            invalid_stream(L, rd);
+        }
+        lua_rawgeti(L, rd->shared, (int)i + 1);
+        break;
+    }
+    case TYPE_EXT_SCHEMA_DEF:
+        unpack_schema(L, rd);
+        break;
+    case TYPE_EXT_RECORD:
+        unpack_record(L, rd);
+        break;
+    case TYPE_EXT_PACKED:
+        unpack_packed(L, rd);
+        break;
+    case TYPE_EXT_FUNCTIONS:
+        if (rd->functions == 0) {
+            invalid_stream(L, rd);
+        }
+        lua_newtable(L);
+        lua_replace(L, rd->functions);
+        rd->functions_count = 0;
+        rd->functions_new = 1;
+        unpack_one(L, rd);
+        break;
+    case TYPE_EXT_FUNCTION_REF: {
+        uint64_t i = get_varint(L, rd);
+        if (rd->functions_count < 0 || i >= (uint64_t)rd->functions_count) {
+            invalid_stream(L, rd);
+        }
+        lua_rawgeti(L, rd->functions, (int)i + 1);
+        break;
+    }
+    default:
+        invalid_stream(L, rd);
+        break;
+    }
+}
+
 static void
 unpack_table(lua_State *L, struct reader *rd, int array_size) {
     if (array_size == MAX_COOKIE-1) {
@@ -547,11 +1594,22 @@ unpack_table(lua_State *L, struct reader *rd, int array_size) {
     }
     luaL_checkstack(L,LUA_MINSTACK,NULL);
     lua_createtable(L,array_size,0);
+    if (rd->shared_count >= 0) {
+        // 先登记再读取内容, 内容中可能引用到这个table自身
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, rd->shared, ++rd->shared_count);
+    }
     int i;
     for (i=1;i<=array_size;i++) {
         unpack_one(L,rd);
         lua_rawseti(L,-2,i);
     }
+    unpack_hash(L, rd);
+}
+
+// 读取table的hash部分, 以nil结尾
+static void
+unpack_hash(lua_State *L, struct reader *rd) {
     for (;;) {
         unpack_one(L,rd);
         if (lua_isnil(L,-1)) {
@@ -563,15 +1621,111 @@ unpack_table(lua_State *L, struct reader *rd, int array_size) {
     }
 }
 
+// 字节码 -> 加载好的函数, 每个lua_State一张. 键是字节码散列值, 值是{字节码, 函数}, 命中时比较完整的字节码
+static char function_load_cache_key;
+
+// 每次取8字节做乘法混合, 只用于在缓存中定位
+static uint64_t
+bytecode_hash(const char *p, size_t len) {
+    const uint64_t m = 0x9E3779B97F4A7C15ULL;
+    uint64_t h = len * m;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        h = (h ^ v) * m;
+        h ^= h >> 29;
+        p += 8;
+        len -= 8;
+    }
+    uint64_t v = 0;
+    memcpy(&v, p, len);
+    h = (h ^ v) * m;
+    h ^= h >> 32;
+    return h;
+}
+
 static void
-push_function(lua_State *L, struct reader *rd, int len) {
-    get_buffer(L, rd, len);
-    size_t sz;
-    const char *bytecode = lua_tolstring(L, -1, &sz);
-    if (luaL_loadbuffer(L, bytecode, sz, "function") != 0) {
+load_function(lua_State *L, const char *bytecode, int len) {
+    if (luaL_loadbuffer(L, bytecode, len, "function") != 0) {
         luaL_error(L, "加载函数失败: %s", lua_tostring(L, -1));
     }
-    lua_remove(L, -2);
+}
+
+static void
+load_cached_function(lua_State *L, const char *bytecode, int len) {
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    lua_pushlightuserdata(L, &function_load_cache_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, &function_load_cache_key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+    }
+    int cache = lua_gettop(L);
+    // 只取53位, Lua 5.1和5.3+都能作为数字键精确保存
+    lua_Number key = (lua_Number)(bytecode_hash(bytecode, len) & ((1ULL << 53) - 1));
+    lua_pushnumber(L, key);
+    lua_rawget(L, cache);
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        size_t sz;
+        const char *cached = lua_tolstring(L, -1, &sz);
+        if (sz == (size_t)len && memcmp(cached, bytecode, len) == 0) {
+            lua_rawgeti(L, -2, 2);
+            lua_replace(L, cache);
+            lua_settop(L, cache);
+            return;
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    load_function(L, bytecode, len);
+    lua_pushliteral(L, "n");
+    lua_rawget(L, cache);
+    int n = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (n >= FUNCTION_CACHE_MAX) {
+        // 缓存满了整个换掉, 不常用的函数随旧表一起回收
+        lua_newtable(L);
+        lua_replace(L, cache);
+        lua_pushlightuserdata(L, &function_load_cache_key);
+        lua_pushvalue(L, cache);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        n = 0;
+    }
+    lua_createtable(L, 2, 0);
+    lua_pushlstring(L, bytecode, len);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, 2);
+    lua_pushnumber(L, key);
+    lua_insert(L, -2);
+    lua_rawset(L, cache);
+    lua_pushliteral(L, "n");
+    lua_pushinteger(L, n + 1);
+    lua_rawset(L, cache);
+    lua_replace(L, cache);
+}
+
+// 直接从读取位置加载字节码, 不创建中间字符串
+static void
+push_function(lua_State *L, struct reader *rd, int len) {
+    const char *bytecode = reader_read(rd, len);
+    if (bytecode == NULL) {
+        invalid_stream(L, rd);
+    }
+    if (rd->cache_functions) {
+        load_cached_function(L, bytecode, len);
+    } else {
+        load_function(L, bytecode, len);
+    }
+    if (rd->functions_count >= 0) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, rd->functions, ++rd->functions_count);
+    }
 }
 
 static void
@@ -587,26 +1741,29 @@ push_value(lua_State *L, struct reader *rd, int type, int cookie) {
         if (cookie == TYPE_NUMBER_REAL) {
             lua_pushnumber(L,get_real(L,rd));
         } else {
-            int64_t n = get_integer(L, rd, cookie);
-            if (llabs(n) > MAX_LUA_INTEGER) {
-                lua_pushnumber(L, (lua_Number)n);
-            } else {
-                lua_pushinteger(L, (lua_Integer)n);
-            }
+            push_int64(L, get_integer(L, rd, cookie));
         }
         break;
+    case TYPE_USERDATA:
+        push_ext(L, rd, cookie);
+        break;
     case TYPE_SHORT_STRING:
-        get_buffer(L,rd,cookie);
+        get_short_string(L,rd,cookie);
         break;
     case TYPE_LONG_STRING: {
-        if (cookie == 2) {
+        if (cookie == 1) {
+            uint64_t n = get_varint(L, rd);
+            if (n > INT_MAX) {
+                invalid_stream(L,rd);
+            }
+            get_buffer(L,rd,(int)n);
+        } else if (cookie == 2) {
             const uint16_t *plen = reader_read(rd, 2);
             if (plen == NULL) {
                 invalid_stream(L,rd);
             }
             uint16_t n;
-            memcpy(&n, plen, sizeof(n));
-            CONVERT(n);
+            n = load_be16(plen);
             get_buffer(L,rd,n);
         } else {
             if (cookie != 4) {
@@ -617,8 +1774,7 @@ push_value(lua_State *L, struct reader *rd, int type, int cookie) {
                 invalid_stream(L,rd);
             }
             uint32_t n;
-            memcpy(&n, plen, sizeof(n));
-            CONVERT(n);
+            n = load_be32(plen);
             get_buffer(L,rd,n);
         }
         break;
@@ -661,112 +1817,499 @@ unpack_one(lua_State *L, struct reader *rd) {
     push_value(L, rd, *t & 0x7, *t >> 3);
 }
 
+// 解析解压参数: 选项对象, 压缩方式名称, 或false表示不解压
+static void check_codec(lua_State *L, int index, struct options *opt) {
+    options_default(opt); // 默认使用Snappy解压
+    struct options *popt = options_test(L, index);
+    if (popt) {
+        *opt = *popt;
+    } else if (lua_type(L, index) == LUA_TSTRING) {
+        const char *compression_type = lua_tostring(L, index);
+        opt->codec = codec_from_name(compression_type);
+        if (opt->codec < 0) {
+            luaL_error(L, "未知的解压类型: %s", compression_type);
+        }
+    } else if (lua_type(L, index) == LUA_TBOOLEAN) {
+        // 如果传入了false,则不解压
+        if (!lua_toboolean(L, index)) {
+            opt->codec = CODEC_NONE;
+        }
+    }
+}
+
 int from_bin(lua_State *L) {
     size_t len;
     const char *compressed_data = luaL_checklstring(L, 1, &len);
-    const char *compression_type = "snappy"; // 默认使用Snappy解压
-
-    // 判断是否传入了压缩方式参数
-    if (lua_gettop(L) >= 2) {
-        if (lua_type(L, 2) == LUA_TSTRING) {
-            compression_type = lua_tostring(L, 2);
-        } else if (lua_type(L, 2) == LUA_TBOOLEAN) {
-            // 如果传入了false,则不解压
-            if (!lua_toboolean(L, 2)) {
-                compression_type = "none";
-            }
-        }
-    }
 
-    char *decompressed_data = NULL;
+    // 判断是否传入了压缩方式参数, 带帧头的数据以帧头中的压缩方式为准
+    struct options opt;
+    check_codec(L, 2, &opt);
+
+    int timed = stats_enabled();
+    uint64_t t0 = timed ? stats_now() : 0;
     size_t decompressed_size = 0;
+    int codec;
+    const char *decompressed_data = codec_decode(L, compressed_data, len, &opt, &decompressed_size, &codec);
+    int scratch = lua_gettop(L);
+    uint64_t t1 = timed ? stats_now() : 0;
 
-    if (strcasecmp(compression_type, "snappy") == 0) {
-        // Google Snappy
-        snappy_status res = snappy_uncompressed_length(compressed_data, len, &decompressed_size);
-        if (res != SNAPPY_OK) {
-            return luaL_error(L, "无法获取Snappy解压后的长度");
-        }
+    struct reader rd;
+    reader_init(&rd, decompressed_data, decompressed_size);
+    // 给驻留表, 引用表, schema表和函数表留出位置, 数据中用到时才会创建
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushnil(L);
+    rd.intern = scratch + 1;
+    rd.shared = scratch + 2;
+    rd.schema = scratch + 3;
+    rd.functions = scratch + 4;
+    rd.cache_functions = opt.cache_functions;
 
-        decompressed_data = (char *)malloc(decompressed_size);
-        if (decompressed_data == NULL) {
-            return luaL_error(L, "内存分配失败");
-        }
+    int count = 0;
+    while (rd.len > 0) {
+        unpack_one(L, &rd);
+        ++count;
+    }
 
-        res = snappy_uncompress(compressed_data, len, decompressed_data, &decompressed_size);
-        if (res != SNAPPY_OK) {
-            free(decompressed_data);
-            return luaL_error(L, "Snappy解压失败");
-        }
-    } else if (strcasecmp(compression_type, "zlib") == 0) {
-        // Zlib
-        uLongf estimated_size = len * 4;
-        decompressed_data = (char *)malloc(estimated_size);
-        if (decompressed_data == NULL) {
-            return luaL_error(L, "内存分配失败");
-        }
+    codec_release(L, scratch);
 
-        int res;
-        while (1) {
-            res = uncompress((Bytef *)decompressed_data, &estimated_size, (const Bytef *)compressed_data, len);
-            if (res == Z_OK) {
-                decompressed_size = estimated_size;
-                break;
-            } else if (res == Z_BUF_ERROR) {
-                estimated_size *= 2;
-                char *new_buffer = (char *)realloc(decompressed_data, estimated_size);
-                if (new_buffer == NULL) {
-                    free(decompressed_data);
-                    return luaL_error(L, "内存分配失败");
-                }
-                decompressed_data = new_buffer;
-            } else {
-                free(decompressed_data);
-                return luaL_error(L, "Zlib解压失败");
-            }
-        }
-    } else if (strcasecmp(compression_type, "zstd") == 0) {
-        // Zstd
-        unsigned long long estimated_size = ZSTD_getFrameContentSize(compressed_data, len);
-        if (estimated_size == ZSTD_CONTENTSIZE_ERROR || estimated_size == ZSTD_CONTENTSIZE_UNKNOWN) {
-            return luaL_error(L, "无法获取Zstd解压后的长度");
-        }
+    if (timed) {
+        stats_add(codec, STATS_MATERIALIZE_NS, stats_now() - t1);
+        stats_add(codec, STATS_DECOMPRESS_NS, t1 - t0);
+        stats_add(codec, STATS_DECODE_CALLS, 1);
+        stats_add(codec, STATS_DECODE_RAW, decompressed_size);
+        stats_add(codec, STATS_DECODE_COMPRESSED, len);
+    }
+    return count;
+}
 
-        decompressed_data = (char *)malloc(estimated_size);
-        if (decompressed_data == NULL) {
-            return luaL_error(L, "内存分配失败");
-        }
+#define DECODER_META "cseri.decoder"
+#define DECODER_WINDOW (64 * 1024)
+
+// 流式解码器: 从来源函数逐块读取压缩数据, 边解压边解析, 内存只占用一个解压窗口
+struct decoder {
+    lua_State *L;
+    struct codec_stream *cs;
+    int source;         // 来源函数的引用
+    int chunk;          // 当前输入块的引用, 解压时直接读取字符串内存
+    int dict;           // 字典的引用
+    int intern;         // 驻留表的引用, 驻留表在多次read之间保留
+    int shared;         // 引用表的引用
+    int schema;         // schema表的引用
+    int functions;      // 函数表的引用
+    const char *in;
+    size_t in_len;
+    int eof;
+    int busy;
+    char *window;
+    size_t cap;
+    struct reader rd;
+};
 
-        size_t res = ZSTD_decompress(decompressed_data, estimated_size, compressed_data, len);
-        if (ZSTD_isError(res)) {
-            free(decompressed_data);
-            return luaL_error(L, "Zstd解压失败: %s", ZSTD_getErrorName(res));
-        }
-        decompressed_size = res;
-    } else if (strcasecmp(compression_type, "none") == 0 || strcasecmp(compression_type, "no") == 0) {
-        // 不解压
-        decompressed_data = (char *)malloc(len);
-        if (decompressed_data == NULL) {
-            return luaL_error(L, "内存分配失败");
+static void decoder_pull(lua_State *L, struct decoder *dec) {
+    luaL_checkstack(L, 2, NULL);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->chunk);
+    dec->chunk = LUA_NOREF;
+    dec->in = NULL;
+    dec->in_len = 0;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->source);
+    lua_call(L, 0, 1);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        dec->eof = 1;
+        return;
+    }
+    if (lua_type(L, -1) != LUA_TSTRING) {
+        luaL_error(L, "数据来源只能返回字符串或nil");
+    }
+    dec->in = lua_tolstring(L, -1, &dec->in_len);
+    dec->chunk = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static int decoder_fill(struct reader *rd, int size) {
+    struct decoder *dec = (struct decoder *)rd->ud;
+    lua_State *L = dec->L;
+
+    // 未读完的部分移到窗口开头, 单个值放不下时扩大窗口
+    size_t len = rd->len;
+    if (len > 0)
+        memmove(dec->window, rd->buffer + rd->ptr, len);
+    if ((size_t)size > dec->cap || dec->window == NULL) {
+        size_t cap = dec->cap ? dec->cap : DECODER_WINDOW;
+        while (cap < (size_t)size)
+            cap *= 2;
+        char *window = (char *)realloc(dec->window, cap);
+        if (window == NULL) {
+            luaL_error(L, "内存分配失败");
         }
-        memcpy(decompressed_data, compressed_data, len);
-        decompressed_size = len;
-    } else {
-        return luaL_error(L, "未知的解压类型: %s", compression_type);
+        dec->window = window;
+        dec->cap = cap;
     }
+    rd->buffer = dec->window;
+    rd->ptr = 0;
 
-    struct reader rd;
-    reader_init(&rd, decompressed_data, decompressed_size);
+    while (len < (size_t)size) {
+        if (dec->in_len == 0 && !dec->eof)
+            decoder_pull(L, dec);
+        size_t got = codec_stream_read(L, dec->cs, &dec->in, &dec->in_len, dec->eof,
+                dec->window + len, dec->cap - len);
+        len += got;
+        if (got == 0 && dec->in_len == 0 && dec->eof)
+            break;
+    }
+    rd->len = len;
+    return len >= (size_t)size;
+}
 
-    int count = 0;
-    while (rd.ptr < rd.len) {
-        unpack_one(L, &rd);
-        ++count;
+static int decoder_read_body(lua_State *L) {
+    struct decoder *dec = (struct decoder *)lua_touserdata(L, 1);
+    dec->L = L;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->intern);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->shared);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->schema);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, dec->functions);
+    dec->rd.intern = 2;
+    dec->rd.shared = 3;
+    dec->rd.schema = 4;
+    dec->rd.functions = 5;
+    if (dec->rd.len == 0 && !decoder_fill(&dec->rd, 1)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, 1);
+    unpack_one(L, &dec->rd);
+    if (dec->rd.intern_new) {
+        // 数据中出现了新的驻留标记, 换成新建的驻留表
+        luaL_unref(L, LUA_REGISTRYINDEX, dec->intern);
+        lua_pushvalue(L, 2);
+        dec->intern = luaL_ref(L, LUA_REGISTRYINDEX);
+        dec->rd.intern_new = 0;
+    }
+    if (dec->rd.shared_new) {
+        luaL_unref(L, LUA_REGISTRYINDEX, dec->shared);
+        lua_pushvalue(L, 3);
+        dec->shared = luaL_ref(L, LUA_REGISTRYINDEX);
+        dec->rd.shared_new = 0;
+    }
+    if (dec->rd.schema_new) {
+        lua_pushvalue(L, 4);
+        dec->schema = luaL_ref(L, LUA_REGISTRYINDEX);
+        dec->rd.schema_new = 0;
     }
+    if (dec->rd.functions_new) {
+        luaL_unref(L, LUA_REGISTRYINDEX, dec->functions);
+        lua_pushvalue(L, 5);
+        dec->functions = luaL_ref(L, LUA_REGISTRYINDEX);
+        dec->rd.functions_new = 0;
+    }
+    return 2;
+}
 
-    free(decompressed_data);
+// dec:read() 解出下一个值, 返回true和该值; 数据已读完时返回false.
+// 在保护模式下解析, 出错时(数据无效, 来源函数报错等)先清除使用标记再抛出错误
+static int decoder_read(lua_State *L) {
+    struct decoder *dec = (struct decoder *)luaL_checkudata(L, 1, DECODER_META);
+    if (dec->busy) {
+        return luaL_error(L, "解码器正在使用中");
+    }
+    dec->busy = 1;
+    lua_settop(L, 1);
+    lua_pushcfunction(L, decoder_read_body);
+    lua_insert(L, 1);
+    int err = lua_pcall(L, 1, LUA_MULTRET, 0);
+    dec->busy = 0;
+    if (err) {
+        return lua_error(L);
+    }
+    return lua_gettop(L);
+}
 
-    return count;
+static int decoder_gc(lua_State *L) {
+    struct decoder *dec = (struct decoder *)lua_touserdata(L, 1);
+    codec_stream_free(dec->cs);
+    dec->cs = NULL;
+    free(dec->window);
+    dec->window = NULL;
+    dec->cap = 0;
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->source);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->chunk);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->dict);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->intern);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->shared);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->schema);
+    luaL_unref(L, LUA_REGISTRYINDEX, dec->functions);
+    dec->source = dec->chunk = dec->dict = dec->intern = dec->shared = dec->schema = dec->functions = LUA_NOREF;
+    return 0;
+}
+
+int decoder_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    struct options opt;
+    check_codec(L, 2, &opt);
+
+    struct decoder *dec = (struct decoder *)lua_newuserdata(L, sizeof(*dec));
+    memset(dec, 0, sizeof(*dec));
+    dec->source = LUA_NOREF;
+    dec->chunk = LUA_NOREF;
+    dec->dict = LUA_NOREF;
+    dec->intern = LUA_NOREF;
+    dec->shared = LUA_NOREF;
+    dec->schema = LUA_NOREF;
+    dec->functions = LUA_NOREF;
+    reader_init(&dec->rd, NULL, 0);
+    dec->rd.fill = decoder_fill;
+    dec->rd.ud = dec;
+    dec->rd.cache_functions = opt.cache_functions;
+    if (luaL_newmetatable(L, DECODER_META)) {
+        lua_pushcfunction(L, decoder_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_newtable(L);
+        lua_pushcfunction(L, decoder_read);
+        lua_setfield(L, -2, "read");
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    dec->cs = codec_stream_new(&opt);
+    if (dec->cs == NULL) {
+        return luaL_error(L, "内存分配失败");
+    }
+    lua_pushvalue(L, 1);
+    dec->source = luaL_ref(L, LUA_REGISTRYINDEX);
+    dec->dict = options_ref_dict(L, 2);
+    return 1;
+}
+
+#define ENCODER_META "cseri.encoder"
+
+// 流式编码器: 序列化的数据每攒够一段就压缩并交给sink, 内存只占用一段数据
+struct encoder {
+    lua_State *L;
+    struct codec_writer *w;
+    int sink;           // 输出函数或文件的引用
+    int dict;           // 字典的引用
+    int intern;         // 驻留表的引用, 没有开启驻留时为LUA_NOREF
+    int shared;         // 是否记录table引用
+    int schema;         // schema字段表数组的引用
+    int schema_defined; // 已写出定义的schema序号表的引用, schema定义在多次write之间保留
+    int busy;
+    int closed;
+    struct buffer bf;
+    struct packer pk;
+};
+
+// sink是io库打开的文件时返回FILE*
+static FILE *sink_file(lua_State *L, int index) {
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *p = (luaL_Stream *)luaL_testudata(L, index, LUA_FILEHANDLE);
+    if (p == NULL)
+        return NULL;
+    if (p->closef == NULL) {
+        luaL_error(L, "文件已关闭");
+    }
+    return p->f;
+#else
+    FILE **pf = (FILE **)lua_touserdata(L, index);
+    if (pf == NULL || !lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (!same)
+        return NULL;
+    if (*pf == NULL) {
+        luaL_error(L, "文件已关闭");
+    }
+    return *pf;
+#endif
+}
+
+static void encoder_output(void *ud, const char *data, size_t len) {
+    struct encoder *enc = (struct encoder *)ud;
+    lua_State *L = enc->L;
+    luaL_checkstack(L, 2, NULL);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, enc->sink);
+    if (lua_type(L, -1) == LUA_TFUNCTION) {
+        lua_pushlstring(L, data, len);
+        lua_call(L, 1, 0);
+        return;
+    }
+    FILE *fp = sink_file(L, -1);
+    lua_pop(L, 1);
+    if (fwrite(data, 1, len, fp) != len) {
+        luaL_error(L, "写入文件失败");
+    }
+}
+
+static void encoder_flush_buffer(struct buffer *bf) {
+    struct encoder *enc = (struct encoder *)bf->ud;
+    codec_writer_write(enc->L, enc->w, bf);
+}
+
+// 在保护模式下执行body(enc, ...), 出错时(sink报错, 值无法序列化等)先清除使用标记再抛出错误.
+// 出错的那次调用写出的数据可能不完整
+static int encoder_call(lua_State *L, lua_CFunction body) {
+    struct encoder *enc = (struct encoder *)luaL_checkudata(L, 1, ENCODER_META);
+    if (enc->closed) {
+        return luaL_error(L, "编码器已关闭");
+    }
+    if (enc->busy) {
+        return luaL_error(L, "编码器正在使用中");
+    }
+    enc->busy = 1;
+    enc->L = L;
+    enc->bf.L = L;
+    lua_pushcfunction(L, body);
+    lua_insert(L, 1);
+    int err = lua_pcall(L, lua_gettop(L) - 1, 0, 0);
+    enc->busy = 0;
+    if (err) {
+        return lua_error(L);
+    }
+    return 0;
+}
+
+// 剩余数据送入压缩器并全部输出
+static void encoder_drain(lua_State *L, struct encoder *enc, int end) {
+    codec_writer_write(L, enc->w, &enc->bf);
+    buffer_rewind(&enc->bf);
+    codec_writer_flush(L, enc->w, end);
+}
+
+static int encoder_write_body(lua_State *L) {
+    struct encoder *enc = (struct encoder *)lua_touserdata(L, 1);
+    int top = lua_gettop(L);
+    if (enc->intern != LUA_NOREF && top > 1) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, enc->intern);
+        if (enc->pk.intern == 0) {
+            // 第一次写入值时写出驻留标记
+            packer_intern(&enc->pk, top + 1);
+        }
+        enc->pk.intern = top + 1;
+    }
+    if (top > 1) {
+        // 函数引用同样只在一次write内有效
+        lua_pushnil(L);
+        packer_functions(&enc->pk, lua_gettop(L));
+    }
+    if (enc->shared && top > 1) {
+        // 引用只在一次write内有效, 之后修改过的table再次写入时会完整写出
+        lua_newtable(L);
+        packer_shared(&enc->pk, lua_gettop(L));
+    }
+    if (enc->schema != LUA_NOREF) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, enc->schema);
+        enc->pk.schema = lua_gettop(L);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, enc->schema_defined);
+        enc->pk.schema_defined = lua_gettop(L);
+    }
+    for (int i = 2; i <= top; ++i) {
+        pack_one(L, &enc->pk, i, 0);
+    }
+    return 0;
+}
+
+// enc:write(...) 依次序列化各个参数.
+// 数据攒够一段就交给sink, 这时可能正在遍历某个table, sink中不能修改正在写入的值
+static int encoder_write(lua_State *L) {
+    return encoder_call(L, encoder_write_body);
+}
+
+static int encoder_flush_body(lua_State *L) {
+    struct encoder *enc = (struct encoder *)lua_touserdata(L, 1);
+    encoder_drain(L, enc, 0);
+    return 0;
+}
+
+// enc:flush() 把已写入的数据全部输出, 读取方可以立即解出这些值
+static int encoder_flush(lua_State *L) {
+    return encoder_call(L, encoder_flush_body);
 }
 
+static int encoder_close_body(lua_State *L) {
+    struct encoder *enc = (struct encoder *)lua_touserdata(L, 1);
+    encoder_drain(L, enc, 1);
+    codec_writer_free(enc->w);
+    enc->w = NULL;
+    buffer_free(&enc->bf);
+    enc->closed = 1;
+    return 0;
+}
+
+// enc:close() 结束数据帧, 不会关闭sink
+static int encoder_close(lua_State *L) {
+    return encoder_call(L, encoder_close_body);
+}
+
+static int encoder_gc(lua_State *L) {
+    struct encoder *enc = (struct encoder *)lua_touserdata(L, 1);
+    codec_writer_free(enc->w);
+    enc->w = NULL;
+    enc->bf.L = L;
+    buffer_free(&enc->bf);
+    luaL_unref(L, LUA_REGISTRYINDEX, enc->sink);
+    luaL_unref(L, LUA_REGISTRYINDEX, enc->dict);
+    luaL_unref(L, LUA_REGISTRYINDEX, enc->intern);
+    luaL_unref(L, LUA_REGISTRYINDEX, enc->schema);
+    luaL_unref(L, LUA_REGISTRYINDEX, enc->schema_defined);
+    enc->sink = enc->dict = enc->intern = enc->schema = enc->schema_defined = LUA_NOREF;
+    return 0;
+}
+
+int encoder_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    struct options opt;
+    options_parse(L, 1, &opt);
 
+    lua_getfield(L, 1, "sink");
+    if (lua_type(L, -1) != LUA_TFUNCTION && sink_file(L, -1) == NULL) {
+        return luaL_error(L, "sink只能是函数或文件");
+    }
+
+    struct encoder *enc = (struct encoder *)lua_newuserdata(L, sizeof(*enc));
+    memset(enc, 0, sizeof(*enc));
+    enc->L = L;
+    enc->sink = LUA_NOREF;
+    enc->dict = LUA_NOREF;
+    enc->intern = LUA_NOREF;
+    enc->schema = LUA_NOREF;
+    enc->schema_defined = LUA_NOREF;
+    buffer_initialize(&enc->bf, L);
+    enc->bf.flush = encoder_flush_buffer;
+    enc->bf.ud = enc;
+    packer_init(&enc->pk, &enc->bf);
+    if (luaL_newmetatable(L, ENCODER_META)) {
+        lua_pushcfunction(L, encoder_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_newtable(L);
+        lua_pushcfunction(L, encoder_write);
+        lua_setfield(L, -2, "write");
+        lua_pushcfunction(L, encoder_flush);
+        lua_setfield(L, -2, "flush");
+        lua_pushcfunction(L, encoder_close);
+        lua_setfield(L, -2, "close");
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+
+    enc->w = codec_writer_new(L, &opt, encoder_output, enc);
+    lua_pushvalue(L, -2);
+    enc->sink = luaL_ref(L, LUA_REGISTRYINDEX);
+    enc->dict = options_ref_dict(L, 1);
+    if (opt.intern) {
+        lua_newtable(L);
+        enc->intern = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    enc->shared = opt.shared;
+    enc->pk.packed = opt.packed;
+    enc->pk.varint = opt.varint;
+    enc->pk.strip = opt.strip;
+    enc->schema = options_ref_schema(L, 1);
+    if (enc->schema != LUA_NOREF) {
+        lua_newtable(L);
+        enc->schema_defined = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    return 1;
+}
@@ -1,6 +1,71 @@
+#include <lauxlib.h>
 #include <string.h>
 #include "buffer.h"
 
+#define BUFFER_POOL_META "cseri.buffer_pool"
+
+// 每个lua_State保留一组用过的块, 反复序列化时不必每次向lua_Alloc申请和释放
+struct buffer_pool {
+    struct block *free;
+    size_t kept;        // free中各块的总长
+    size_t estimate;    // 最近的数据长度: 变长时直接取新值, 变短时逐次衰减
+};
+
+static int buffer_pool_key;
+
+static int buffer_pool_gc(lua_State *L) {
+    struct buffer_pool *pool = (struct buffer_pool *)lua_touserdata(L, 1);
+    void *ud;
+    lua_Alloc alloc = lua_getallocf(L, &ud);
+    struct block *p = pool->free;
+    while (p) {
+        struct block *t = p->next;
+        alloc(ud, p, p->len + sizeof(struct block), 0);
+        p = t;
+    }
+    memset(pool, 0, sizeof(*pool));
+    return 0;
+}
+
+static struct buffer_pool *buffer_pool(lua_State *L) {
+    lua_pushlightuserdata(L, &buffer_pool_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    struct buffer_pool *pool = (struct buffer_pool *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (pool)
+        return pool;
+
+    pool = (struct buffer_pool *)lua_newuserdata(L, sizeof(*pool));
+    memset(pool, 0, sizeof(*pool));
+    if (luaL_newmetatable(L, BUFFER_POOL_META)) {
+        lua_pushcfunction(L, buffer_pool_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, &buffer_pool_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+    return pool;
+}
+
+// 取出长度不小于len的块中最短的一块, 没有时返回NULL
+static struct block *buffer_pool_take(struct buffer_pool *pool, int len) {
+    struct block **best = NULL;
+    for (struct block **pp = &pool->free; *pp; pp = &(*pp)->next) {
+        if ((*pp)->len >= len && (best == NULL || (*pp)->len < (*best)->len))
+            best = pp;
+    }
+    if (best == NULL)
+        return NULL;
+    struct block *p = *best;
+    *best = p->next;
+    pool->kept -= p->len;
+    p->p = 0;
+    p->next = NULL;
+    return p;
+}
+
 void buffer_initialize(struct buffer *b, lua_State *L) {
     b->L = L;
     b->head = (struct block*)&b->stack;
@@ -8,18 +73,67 @@ void buffer_initialize(struct buffer *b, lua_State *L) {
     b->head->len = INITIAL_SIZE;
     b->head->next = NULL;
     b->curr = b->head;
+    b->flush = NULL;
+    b->ud = NULL;
+    b->base = 0;
+    b->pool = NULL;
+    b->blocks = 0;
 }
 
-static struct block *_buffer_new_block(struct buffer *b) {
+static struct block *_buffer_alloc_block(struct buffer *b, int len) {
+    if (b->pool) {
+        struct block *res = buffer_pool_take(b->pool, len);
+        if (res)
+            return res;
+    }
     void *ud;
     lua_Alloc alloc = lua_getallocf(b->L, &ud);
-    struct block *res = (struct block*)alloc(ud, NULL, 0, b->curr->len * 2 + sizeof(struct block));
+    struct block *res = (struct block*)alloc(ud, NULL, 0, len + sizeof(struct block));
+    ++b->blocks;
     res->p = 0;
-    res->len = b->curr->len * 2;
+    res->len = len;
     res->next = NULL;
     return res;
 }
 
+static struct block *_buffer_new_block(struct buffer *b) {
+    return _buffer_alloc_block(b, b->curr->len * 2);
+}
+
+void buffer_initialize_pooled(struct buffer *b, lua_State *L) {
+    buffer_initialize(b, L);
+    b->pool = buffer_pool(L);
+    if (b->pool->estimate > INITIAL_SIZE) {
+        // 直接用一块能放下全部数据的块代替栈上的头块, 大多数调用只用这一块
+        int len = INITIAL_SIZE * 2;
+        while ((size_t)len < b->pool->estimate && len < BUFFER_POOL_MAX_KEEP)
+            len *= 2;
+        b->head = b->curr = _buffer_alloc_block(b, len);
+    }
+}
+
+// 换到下一块; 设置了flush且数据足够长时先输出再从头块开始复用
+static void _buffer_next(struct buffer *b) {
+    if (b->flush && buffer_size(b) >= BUFFER_FLUSH_SIZE) {
+        b->flush(b);
+        buffer_rewind(b);
+        return;
+    }
+    b->base += b->curr->p;
+    if (b->curr->next) {
+        b->curr = b->curr->next;
+    } else {
+        b->curr = b->curr->next = _buffer_new_block(b);
+    }
+}
+
+char *buffer_reserve_slow(struct buffer *b, size_t n) {
+    do {
+        _buffer_next(b);
+    } while ((size_t)(b->curr->len - b->curr->p) < n);
+    return b->curr->data + b->curr->p;
+}
+
 void buffer_append(struct buffer *b, const char *data, size_t len) {
     size_t space = b->curr->len - b->curr->p;
     while (space < len) {
@@ -29,8 +143,8 @@ void buffer_append(struct buffer *b, const char *data, size_t len) {
             b->curr->p += space;
             len -= space;
         }
-        b->curr = b->curr->next = _buffer_new_block(b);
-        space = b->curr->len;
+        _buffer_next(b);
+        space = b->curr->len - b->curr->p;
     }
     memcpy(b->curr->data + b->curr->p, data, len);
     b->curr->p += len;
@@ -39,18 +153,45 @@ void buffer_append(struct buffer *b, const char *data, size_t len) {
 void buffer_free(struct buffer *b) {
     void *ud;
     lua_Alloc alloc = lua_getallocf(b->L, &ud);
+    struct buffer_pool *pool = b->pool;
+    if (pool) {
+        size_t size = buffer_size(b);
+        pool->estimate = size > pool->estimate ? size : pool->estimate - (pool->estimate - size) / 4;
+    }
     struct block *p = b->head;
     while (p) {
         struct block *t = p->next;
-        if (p != (struct block*)&b->stack)
-            alloc(ud, p, p->len + sizeof(struct block), 0);
+        if (p != (struct block*)&b->stack) {
+            if (pool && pool->kept + p->len <= BUFFER_POOL_MAX_KEEP) {
+                p->next = pool->free;
+                pool->free = p;
+                pool->kept += p->len;
+            } else {
+                alloc(ud, p, p->len + sizeof(struct block), 0);
+            }
+        }
         p = t;
     }
+    b->pool = NULL;
+    // 释放后恢复成空缓冲区, 重复释放也是安全的
+    b->head = b->curr = (struct block*)&b->stack;
+    b->head->p = 0;
+    b->head->next = NULL;
+    b->base = 0;
+}
+
+// 清空数据但保留已分配的块
+void buffer_rewind(struct buffer *b) {
+    for (struct block *p = b->head; p; p = p->next)
+        p->p = 0;
+    b->curr = b->head;
+    b->base = 0;
 }
 
 void buffer_push_string(struct buffer *b) {
     size_t size = buffer_size(b);
-    if (size <= INITIAL_SIZE) {
+    if (b->curr == b->head) {
+        // 数据都在头块中
         lua_pushlstring(b->L, b->head->data, size);
     } else {
         void *ud;
@@ -4,6 +4,9 @@
 #include <lua.h>
 
 #define INITIAL_SIZE 1024
+// 设置了flush时, 数据超过这个长度就交给flush输出, 然后从头块开始复用已有的块
+#define BUFFER_FLUSH_SIZE (64 * 1024)
+#define BUFFER_POOL_MAX_KEEP (16 * 1024 * 1024)  // 块池最多保留的内存
 
 struct block {
     int p;
@@ -16,6 +19,11 @@ struct buffer {
     lua_State *L;
     struct block *head;
     struct block *curr;
+    void (*flush)(struct buffer *b);
+    void *ud;
+    size_t base;        // curr之前各块的数据总长
+    struct buffer_pool *pool;
+    int blocks;         // 新分配的块数, 从块池取出的不算
     struct {
         int p;
         int len;
@@ -25,17 +33,33 @@ struct buffer {
 };
 
 void buffer_initialize(struct buffer *b, lua_State *L);
+// 从当前lua_State的块池取块, 释放时归还; 按最近的数据长度直接从一块足够大的块开始写.
+// 块池在lua_close时回收, 只能用于调用期间的临时缓冲区, 不能用于userdata中长期存活的缓冲区
+void buffer_initialize_pooled(struct buffer *b, lua_State *L);
 void buffer_append(struct buffer *b, const char *data, size_t len);
 void buffer_free(struct buffer *b);
+void buffer_rewind(struct buffer *b);
 void buffer_push_string(struct buffer *b);
+char *buffer_reserve_slow(struct buffer *b, size_t n);
+
+// 返回至少可以连续写入n字节的位置, 写入后用buffer_commit提交实际写入的长度. n不能超过INITIAL_SIZE,
+// 当前块剩余空间不够时换到下一块, 剩余空间不再使用
+inline static char *buffer_reserve(struct buffer *b, size_t n) {
+    if ((size_t)(b->curr->len - b->curr->p) >= n)
+        return b->curr->data + b->curr->p;
+    return buffer_reserve_slow(b, n);
+}
+
+#define buffer_commit(b, n) ((b)->curr->p += (int)(n))
 
 inline static void buffer_append_char(struct buffer *b, char c) {
-    buffer_append(b, &c, 1);
+    *buffer_reserve(b, 1) = c;
+    buffer_commit(b, 1);
 }
 
 #define buffer_append_str(b, str) buffer_append((b), (str), strlen(str))
 #define buffer_append_lstr buffer_append
 
-#define buffer_size(b) ((b)->curr->len - INITIAL_SIZE + (b)->curr->p)
+#define buffer_size(b) ((b)->base + (b)->curr->p)
 
 #endif //_BUFFER_H_
@@ -0,0 +1,1798 @@
+#include <lauxlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/uio.h>
+#include <zlib.h> // Zlib
+#include <snappy-c.h> // Google Snappy
+#include <zstd.h> // Zstd
+#include "common.h"
+#include "codec.h"
+#include "dict.h"
+#include "options.h"
+#include "parallel.h"
+
+#define MAX_STACK_IOV 32
+#define CODEC_CTX_META "cseri.codec"
+#define SCRATCH_META "cseri.scratch"
+#define SCRATCH_MAX_KEEP (32 * 1024 * 1024)
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+#define PARALLEL_MAX_IOV 64
+// 分块长度由int类型的job_size决定, 块头中更大的长度一定是伪造的; 压缩后最坏比原始数据长约1/6(Snappy)
+#define CHUNK_MAX_RAW ((uint64_t)INT_MAX)
+#define CHUNK_MAX_COMP (CHUNK_MAX_RAW + CHUNK_MAX_RAW / 4)
+#define ZSTD_MT_MIN_SIZE (2 * 1024 * 1024)
+#define ZSTD_MT_MIN_JOB (1024 * 1024)
+#define ZSTD_MT_MAX_JOB (512 * 1024 * 1024)
+
+// 每个lua_State缓存一组压缩/解压上下文, 避免每次调用都重新创建
+struct codec_ctx {
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_level;
+    int deflate_ready;
+    int inflate_ready;
+};
+
+static int codec_ctx_key;
+
+static int codec_ctx_gc(lua_State *L) {
+    struct codec_ctx *ctx = (struct codec_ctx *)lua_touserdata(L, 1);
+    ZSTD_freeCCtx(ctx->zstd_cctx);
+    ZSTD_freeDCtx(ctx->zstd_dctx);
+    if (ctx->deflate_ready)
+        deflateEnd(&ctx->deflate);
+    if (ctx->inflate_ready)
+        inflateEnd(&ctx->inflate);
+    memset(ctx, 0, sizeof(*ctx));
+    return 0;
+}
+
+// 取得当前lua_State的上下文缓存, 首次调用时创建并挂在注册表上
+static struct codec_ctx *codec_ctx(lua_State *L) {
+    lua_pushlightuserdata(L, &codec_ctx_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    struct codec_ctx *ctx = (struct codec_ctx *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (ctx)
+        return ctx;
+
+    ctx = (struct codec_ctx *)lua_newuserdata(L, sizeof(*ctx));
+    memset(ctx, 0, sizeof(*ctx));
+    if (luaL_newmetatable(L, CODEC_CTX_META)) {
+        lua_pushcfunction(L, codec_ctx_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushlightuserdata(L, &codec_ctx_key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+    return ctx;
+}
+
+static z_stream *ctx_deflate(struct codec_ctx *ctx, int level) {
+    if (!ctx->deflate_ready) {
+        if (deflateInit(&ctx->deflate, level) != Z_OK)
+            return NULL;
+        ctx->deflate_ready = 1;
+    } else {
+        deflateReset(&ctx->deflate);
+        if (ctx->deflate_level != level && deflateParams(&ctx->deflate, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return NULL;
+    }
+    ctx->deflate_level = level;
+    return &ctx->deflate;
+}
+
+static z_stream *ctx_inflate(struct codec_ctx *ctx) {
+    if (!ctx->inflate_ready) {
+        if (inflateInit(&ctx->inflate) != Z_OK)
+            return NULL;
+        ctx->inflate_ready = 1;
+    } else {
+        inflateReset(&ctx->inflate);
+    }
+    return &ctx->inflate;
+}
+
+static ZSTD_CCtx *ctx_zstd_cctx(struct codec_ctx *ctx, int level) {
+    if (ctx->zstd_cctx == NULL) {
+        ctx->zstd_cctx = ZSTD_createCCtx();
+        if (ctx->zstd_cctx == NULL)
+            return NULL;
+    } else {
+        ZSTD_CCtx_reset(ctx->zstd_cctx, ZSTD_reset_session_and_parameters);
+    }
+    ZSTD_CCtx_setParameter(ctx->zstd_cctx, ZSTD_c_compressionLevel, level);
+    return ctx->zstd_cctx;
+}
+
+// 开启多线程压缩. libzstd编译时没有开启多线程时设置会失败, 此时仍用单线程压缩
+static void zstd_workers(ZSTD_CCtx *cctx, const struct options *opt, size_t size) {
+    if (opt->workers <= 0 || (size != FRAME_SIZE_UNKNOWN && size < ZSTD_MT_MIN_SIZE))
+        return;
+    if (ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, opt->workers)))
+        return;
+    size_t job = opt->job_size;
+    if (job == 0 && size != FRAME_SIZE_UNKNOWN) {
+        // 每个线程分到几个任务, 避免任务数少于线程数时核心空闲
+        job = size / ((size_t)opt->workers * 4);
+        if (job < ZSTD_MT_MIN_JOB)
+            job = ZSTD_MT_MIN_JOB;
+    }
+    if (job > ZSTD_MT_MAX_JOB)
+        job = ZSTD_MT_MAX_JOB;
+    if (job)
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_jobSize, (int)job);
+}
+
+// 解压上下文会一直记住引用的字典, 每次都重新设置, 不用字典时清掉上次的引用
+static ZSTD_DCtx *ctx_zstd_dctx(struct codec_ctx *ctx, struct dict *dict) {
+    if (ctx->zstd_dctx == NULL) {
+        ctx->zstd_dctx = ZSTD_createDCtx();
+        if (ctx->zstd_dctx == NULL)
+            return NULL;
+    } else {
+        ZSTD_DCtx_reset(ctx->zstd_dctx, ZSTD_reset_session_only);
+    }
+    ZSTD_DDict *ddict = dict ? dict_ddict(dict) : NULL;
+    if ((dict && ddict == NULL) || ZSTD_isError(ZSTD_DCtx_refDDict(ctx->zstd_dctx, ddict)))
+        return NULL;
+    return ctx->zstd_dctx;
+}
+
+// 只有Zlib和Zstd使用字典
+static struct dict *encode_dict(const struct options *opt) {
+    return opt->codec == CODEC_ZLIB || opt->codec == CODEC_ZSTD ? opt->dict : NULL;
+}
+
+int codec_from_name(const char *name) {
+    if (strcasecmp(name, "snappy") == 0)
+        return CODEC_SNAPPY;
+    if (strcasecmp(name, "zlib") == 0)
+        return CODEC_ZLIB;
+    if (strcasecmp(name, "zstd") == 0)
+        return CODEC_ZSTD;
+    if (strcasecmp(name, "none") == 0 || strcasecmp(name, "no") == 0)
+        return CODEC_NONE;
+    return -1;
+}
+
+void codec_check_level(lua_State *L, int codec, int level) {
+    if (codec == CODEC_ZLIB) {
+        if (level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION) {
+            luaL_error(L, "Zlib压缩级别最低为%d, 最高为%d", Z_BEST_SPEED, Z_BEST_COMPRESSION);
+        }
+    } else if (codec == CODEC_ZSTD) {
+        int zstd_min_level = ZSTD_minCLevel();
+        int zstd_max_level = ZSTD_maxCLevel();
+        if (level < zstd_min_level || level > zstd_max_level) {
+            luaL_error(L, "Zstd压缩级别最低为%d, 最高为%d", zstd_min_level, zstd_max_level);
+        }
+    }
+}
+
+static void compress_none(struct buffer *bf, luaL_Buffer *out) {
+    char *dst = luaL_prepbuffsize(out, buffer_size(bf));
+    size_t n = 0;
+    for (struct block *p = bf->head; p; p = p->next) {
+        memcpy(dst + n, p->data, p->p);
+        n += p->p;
+    }
+    luaL_addsize(out, n);
+}
+
+static void compress_snappy(struct buffer *bf, luaL_Buffer *out) {
+    size_t size = buffer_size(bf);
+    size_t compressed_size = snappy_max_compressed_length(size);
+    char *dst = luaL_prepbuffsize(out, compressed_size);
+
+    snappy_status res;
+    if (bf->head->next == NULL) {
+        res = snappy_compress(bf->head->data, size, dst, &compressed_size);
+    } else {
+        // 数据块链直接作为iovec输入
+        struct iovec stack_iov[MAX_STACK_IOV];
+        struct iovec *iov = stack_iov;
+        size_t cnt = 0;
+        for (struct block *p = bf->head; p; p = p->next)
+            ++cnt;
+        if (cnt > MAX_STACK_IOV) {
+            iov = (struct iovec *)malloc(cnt * sizeof(struct iovec));
+            if (iov == NULL) {
+                buffer_free(bf);
+                luaL_error(bf->L, "内存分配失败");
+            }
+        }
+        cnt = 0;
+        for (struct block *p = bf->head; p; p = p->next) {
+            iov[cnt].iov_base = p->data;
+            iov[cnt].iov_len = p->p;
+            ++cnt;
+        }
+        res = snappy_compress_iov(iov, size, dst, &compressed_size);
+        if (iov != stack_iov)
+            free(iov);
+    }
+    if (res != SNAPPY_OK) {
+        buffer_free(bf);
+        luaL_error(bf->L, "Snappy压缩失败");
+    }
+    luaL_addsize(out, compressed_size);
+}
+
+static void compress_zlib(struct buffer *bf, int level, struct dict *dict, luaL_Buffer *out) {
+    struct codec_ctx *ctx = codec_ctx(bf->L);
+    // 输出区按上限一次预留, deflate过程中不会出现输出空间不足
+    uLong bound = compressBound(buffer_size(bf));
+    Bytef *dst = (Bytef *)luaL_prepbuffsize(out, bound);
+
+    z_stream *zs = ctx_deflate(ctx, level);
+    if (zs == NULL || (dict && deflateSetDictionary(zs, (const Bytef *)dict->data, dict->len) != Z_OK)) {
+        buffer_free(bf);
+        luaL_error(bf->L, "Zlib压缩失败");
+    }
+    zs->next_out = dst;
+    zs->avail_out = bound;
+
+    int res = Z_OK;
+    for (struct block *p = bf->head; p; p = p->next) {
+        zs->next_in = (Bytef *)p->data;
+        zs->avail_in = p->p;
+        res = deflate(zs, p->next ? Z_NO_FLUSH : Z_FINISH);
+        if (res == Z_STREAM_ERROR)
+            break;
+    }
+    if (res != Z_STREAM_END) {
+        buffer_free(bf);
+        luaL_error(bf->L, "Zlib压缩失败");
+    }
+    luaL_addsize(out, zs->total_out);
+}
+
+static void compress_zstd(struct buffer *bf, const struct options *opt, luaL_Buffer *out) {
+    struct codec_ctx *ctx = codec_ctx(bf->L);
+    size_t size = buffer_size(bf);
+    size_t bound = ZSTD_compressBound(size);
+    ZSTD_outBuffer output = { luaL_prepbuffsize(out, bound), bound, 0 };
+
+    ZSTD_CCtx *cctx = ctx_zstd_cctx(ctx, opt->level);
+    ZSTD_CDict *cdict = opt->dict ? dict_cdict(opt->dict, opt->level) : NULL;
+    if (cctx == NULL || (opt->dict && (cdict == NULL || ZSTD_isError(ZSTD_CCtx_refCDict(cctx, cdict))))) {
+        buffer_free(bf);
+        luaL_error(bf->L, "内存分配失败");
+    }
+    zstd_workers(cctx, opt, size);
+    // 写入帧头中的原始长度, 解压时据此分配内存
+    ZSTD_CCtx_setPledgedSrcSize(cctx, size);
+
+    size_t res = 0;
+    if (bf->head->next == NULL) {
+        res = ZSTD_compress2(cctx, output.dst, output.size, bf->head->data, size);
+        if (!ZSTD_isError(res)) {
+            output.pos = res;
+            res = 0;
+        }
+    } else {
+        for (struct block *p = bf->head; p; p = p->next) {
+            ZSTD_inBuffer input = { p->data, p->p, 0 };
+            ZSTD_EndDirective mode = p->next ? ZSTD_e_continue : ZSTD_e_end;
+            do {
+                res = ZSTD_compressStream2(cctx, &output, &input, mode);
+                if (ZSTD_isError(res))
+                    break;
+            } while ((mode == ZSTD_e_end ? res != 0 : input.pos < input.size) && output.pos < output.size);
+            if (ZSTD_isError(res) || (res != 0 && output.pos == output.size))
+                break;
+        }
+    }
+    if (ZSTD_isError(res)) {
+        buffer_free(bf);
+        luaL_error(bf->L, "Zstd压缩失败: %s", ZSTD_getErrorName(res));
+    } else if (res != 0) {
+        buffer_free(bf);
+        luaL_error(bf->L, "Zstd压缩失败");
+    }
+    luaL_addsize(out, output.pos);
+}
+
+static void codec_compress(struct buffer *bf, const struct options *opt, luaL_Buffer *out) {
+    switch (opt->codec) {
+    case CODEC_SNAPPY:
+        compress_snappy(bf, out);
+        break;
+    case CODEC_ZLIB:
+        compress_zlib(bf, opt->level, opt->dict, out);
+        break;
+    case CODEC_ZSTD:
+        compress_zstd(bf, opt, out);
+        break;
+    default:
+        compress_none(bf, out);
+        break;
+    }
+}
+
+// 解压缓冲区, 每个lua_State保留一块, 按需成倍扩大
+struct scratch {
+    char *data;
+    size_t cap;
+};
+
+static int scratch_key;
+
+static int scratch_gc(lua_State *L) {
+    struct scratch *s = (struct scratch *)lua_touserdata(L, 1);
+    free(s->data);
+    s->data = NULL;
+    s->cap = 0;
+    return 0;
+}
+
+// 取出解压缓冲区并压入栈顶. 使用期间从注册表上摘下, 解析时若有重入的frombin会另建一块;
+// 出错时缓冲区随栈上的userdata一起被回收
+static struct scratch *scratch_acquire(lua_State *L) {
+    lua_pushlightuserdata(L, &scratch_key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    struct scratch *s = (struct scratch *)lua_touserdata(L, -1);
+    if (s) {
+        lua_pushlightuserdata(L, &scratch_key);
+        lua_pushnil(L);
+        lua_rawset(L, LUA_REGISTRYINDEX);
+        return s;
+    }
+    lua_pop(L, 1);
+
+    s = (struct scratch *)lua_newuserdata(L, sizeof(*s));
+    s->data = NULL;
+    s->cap = 0;
+    if (luaL_newmetatable(L, SCRATCH_META)) {
+        lua_pushcfunction(L, scratch_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    return s;
+}
+
+static char *scratch_reserve(struct scratch *s, size_t size) {
+    if (size <= s->cap)
+        return s->data;
+    // 长度可能来自不可信的帧头, 翻倍会溢出时直接失败
+    if (size > SIZE_MAX / 2)
+        return NULL;
+    size_t cap = s->cap ? s->cap : INITIAL_SIZE;
+    while (cap < size)
+        cap *= 2;
+    char *data = (char *)realloc(s->data, cap);
+    if (data == NULL)
+        return NULL;
+    s->data = data;
+    s->cap = cap;
+    return data;
+}
+
+void codec_release(lua_State *L, int index) {
+    struct scratch *s = (struct scratch *)lua_touserdata(L, index);
+    if (s == NULL)
+        return;
+    if (s->cap > SCRATCH_MAX_KEEP) {
+        // 过大的缓冲区不保留, 避免一次大数据长期占用内存
+        free(s->data);
+        s->data = NULL;
+        s->cap = 0;
+    }
+    lua_pushlightuserdata(L, &scratch_key);
+    lua_pushvalue(L, index);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// 压缩方式的最大压缩率: Snappy每3字节的复制最多展开成64字节, Zlib(deflate)理论上限约1032倍,
+// Zstd的RLE块4字节可以展开成128KB
+static size_t codec_max_ratio(int codec) {
+    switch (codec) {
+    case CODEC_SNAPPY: return 22;
+    case CODEC_ZLIB: return 1032;
+    case CODEC_ZSTD: return 32768;
+    default: return 1;
+    }
+}
+
+// len字节的压缩数据最多能解出的长度, 帧头或块头中超过这个长度的原始长度一定是伪造的
+static size_t max_decompressed(int codec, size_t len) {
+    size_t ratio = codec_max_ratio(codec);
+    size_t slack = codec == CODEC_NONE ? 0 : INITIAL_SIZE;
+    if (len > (SIZE_MAX - slack) / ratio)
+        return SIZE_MAX;
+    return len * ratio + slack;
+}
+
+static char *decompress_snappy(lua_State *L, struct scratch *s, const char *src, size_t len, size_t *size) {
+    size_t expected = *size;
+    snappy_status res = snappy_uncompressed_length(src, len, size);
+    if (res != SNAPPY_OK || (expected != FRAME_SIZE_UNKNOWN && expected != *size)) {
+        luaL_error(L, "无法获取Snappy解压后的长度");
+    }
+    if (*size > max_decompressed(CODEC_SNAPPY, len)) {
+        luaL_error(L, "数据长度不匹配");
+    }
+
+    char *dst = scratch_reserve(s, *size);
+    if (dst == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+
+    res = snappy_uncompress(src, len, dst, size);
+    if (res != SNAPPY_OK) {
+        luaL_error(L, "Snappy解压失败");
+    }
+    return dst;
+}
+
+static char *decompress_zlib(lua_State *L, struct scratch *s, struct dict *dict, const char *src, size_t len,
+        size_t *size) {
+    z_stream *zs = ctx_inflate(codec_ctx(L));
+    if (zs == NULL) {
+        luaL_error(L, "Zlib解压失败");
+    }
+
+    // 帧头给出了原始长度时一次分配到位, 否则按压缩数据长度估算
+    int exact = *size != FRAME_SIZE_UNKNOWN;
+    if (exact && *size > max_decompressed(CODEC_ZLIB, len)) {
+        luaL_error(L, "数据长度不匹配");
+    }
+    size_t estimated_size = exact ? *size : len * 4;
+    if (estimated_size < INITIAL_SIZE)
+        estimated_size = INITIAL_SIZE;
+    char *dst = scratch_reserve(s, estimated_size);
+    if (dst == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+
+    zs->next_in = (Bytef *)src;
+    zs->avail_in = len;
+    zs->next_out = (Bytef *)dst;
+    zs->avail_out = s->cap;
+    for (;;) {
+        int res = inflate(zs, Z_FINISH);
+        if (res == Z_STREAM_END)
+            break;
+        if (res == Z_NEED_DICT && dict && inflateSetDictionary(zs, (const Bytef *)dict->data, dict->len) == Z_OK)
+            continue;
+        if ((res == Z_OK || res == Z_BUF_ERROR) && zs->avail_out == 0 && !exact) {
+            // 输出空间不足时扩容后接着解压, 不必从头再来
+            dst = scratch_reserve(s, s->cap * 2);
+            if (dst == NULL) {
+                luaL_error(L, "内存分配失败");
+            }
+            zs->next_out = (Bytef *)dst + zs->total_out;
+            zs->avail_out = s->cap - zs->total_out;
+            continue;
+        }
+        luaL_error(L, "Zlib解压失败");
+    }
+    if (exact && zs->total_out != *size) {
+        luaL_error(L, "Zlib解压失败");
+    }
+    *size = zs->total_out;
+    return dst;
+}
+
+// 流式写出的Zstd数据不带原始长度, 边解压边扩大缓冲区
+static char *decompress_zstd_stream(lua_State *L, struct scratch *s, struct dict *dict, const char *src, size_t len,
+        size_t *size) {
+    ZSTD_DCtx *dctx = ctx_zstd_dctx(codec_ctx(L), dict);
+    size_t estimated_size = len * 4;
+    if (estimated_size < INITIAL_SIZE)
+        estimated_size = INITIAL_SIZE;
+    char *dst = scratch_reserve(s, estimated_size);
+    if (dctx == NULL || dst == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+
+    ZSTD_inBuffer input = { src, len, 0 };
+    ZSTD_outBuffer output = { dst, s->cap, 0 };
+    for (;;) {
+        size_t res = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(res)) {
+            luaL_error(L, "Zstd解压失败: %s", ZSTD_getErrorName(res));
+        }
+        if (res == 0)
+            break;
+        if (output.pos == output.size) {
+            dst = scratch_reserve(s, s->cap * 2);
+            if (dst == NULL) {
+                luaL_error(L, "内存分配失败");
+            }
+            output.dst = dst;
+            output.size = s->cap;
+        } else if (input.pos == input.size) {
+            luaL_error(L, "数据不完整");
+        }
+    }
+    if (input.pos != input.size) {
+        luaL_error(L, "无效的数据帧");
+    }
+    *size = output.pos;
+    return dst;
+}
+
+static char *decompress_zstd(lua_State *L, struct scratch *s, struct dict *dict, const char *src, size_t len,
+        size_t *size) {
+    unsigned long long estimated_size = ZSTD_getFrameContentSize(src, len);
+    if (estimated_size == ZSTD_CONTENTSIZE_UNKNOWN && *size == FRAME_SIZE_UNKNOWN)
+        return decompress_zstd_stream(L, s, dict, src, len, size);
+    if (estimated_size == ZSTD_CONTENTSIZE_ERROR || estimated_size == ZSTD_CONTENTSIZE_UNKNOWN
+            || (*size != FRAME_SIZE_UNKNOWN && estimated_size != *size)) {
+        luaL_error(L, "无法获取Zstd解压后的长度");
+    }
+    if (estimated_size > max_decompressed(CODEC_ZSTD, len)) {
+        luaL_error(L, "数据长度不匹配");
+    }
+
+    ZSTD_DCtx *dctx = ctx_zstd_dctx(codec_ctx(L), dict);
+    char *dst = scratch_reserve(s, estimated_size);
+    if (dctx == NULL || dst == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+
+    size_t res = ZSTD_decompressDCtx(dctx, dst, estimated_size, src, len);
+    if (ZSTD_isError(res)) {
+        luaL_error(L, "Zstd解压失败: %s", ZSTD_getErrorName(res));
+    }
+    *size = res;
+    return dst;
+}
+
+static const char *codec_decompress(lua_State *L, int codec, struct dict *dict, const char *src, size_t len,
+        size_t *size) {
+    if (codec == CODEC_NONE) {
+        // 不压缩的数据直接在原字符串上解析
+        if (*size != FRAME_SIZE_UNKNOWN && *size != len) {
+            luaL_error(L, "数据长度不匹配");
+        }
+        *size = len;
+        lua_pushnil(L);
+        return src;
+    }
+
+    struct scratch *s = scratch_acquire(L);
+    switch (codec) {
+    case CODEC_SNAPPY:
+        return decompress_snappy(L, s, src, len, size);
+    case CODEC_ZLIB:
+        return decompress_zlib(L, s, dict, src, len, size);
+    default:
+        return decompress_zstd(L, s, dict, src, len, size);
+    }
+}
+
+// 解析块头, 返回块头长度; 数据不足时返回0, 数据无效时返回-1. 结束标记的压缩长度为0
+static int chunk_header(const char *data, size_t len, uint64_t *raw, uint64_t *comp) {
+    int n = varint_decode((const uint8_t *)data, len, raw);
+    if (n == 0)
+        return len >= MAX_VARINT_SIZE ? -1 : 0;
+    *comp = 0;
+    if (*raw == 0)
+        return n;
+    int m = varint_decode((const uint8_t *)data + n, len - n, comp);
+    if (m == 0)
+        return len - n >= MAX_VARINT_SIZE ? -1 : 0;
+    if (*raw > CHUNK_MAX_RAW || *comp > CHUNK_MAX_COMP)
+        return -1;
+    return n + m;
+}
+
+// 带字典的Zlib数据, uncompress无法设置字典, 自己走一遍inflate
+static int inflate_dict(const struct dict *dict, const char *src, size_t len, char *dst, size_t size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return 0;
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)dst;
+    zs.avail_out = size;
+    int res = inflate(&zs, Z_FINISH);
+    if (res == Z_NEED_DICT && inflateSetDictionary(&zs, (const Bytef *)dict->data, dict->len) == Z_OK)
+        res = inflate(&zs, Z_FINISH);
+    int ok = res == Z_STREAM_END && zs.total_out == size;
+    inflateEnd(&zs);
+    return ok;
+}
+
+// 解压一块数据, 不调用Lua API以便在工作线程中使用; 失败时返回错误信息
+static const char *chunk_uncompress(int codec, const struct dict *dict, const char *src, size_t len, char *dst,
+        size_t size) {
+    switch (codec) {
+    case CODEC_SNAPPY: {
+        size_t n = size;
+        if (snappy_uncompress(src, len, dst, &n) != SNAPPY_OK || n != size)
+            return "Snappy解压失败";
+        break;
+    }
+    case CODEC_ZLIB: {
+        if (dict) {
+            if (!inflate_dict(dict, src, len, dst, size))
+                return "Zlib解压失败";
+            break;
+        }
+        uLongf n = size;
+        if (uncompress((Bytef *)dst, &n, (const Bytef *)src, len) != Z_OK || n != size)
+            return "Zlib解压失败";
+        break;
+    }
+    case CODEC_ZSTD: {
+        size_t n = ZSTD_decompress(dst, size, src, len);
+        if (ZSTD_isError(n) || n != size)
+            return "Zstd解压失败";
+        break;
+    }
+    default:
+        if (len != size)
+            return "数据长度不匹配";
+        memcpy(dst, src, size);
+        break;
+    }
+    return NULL;
+}
+
+static void chunk_decompress(lua_State *L, int codec, const struct dict *dict, const char *src, size_t len, char *dst,
+        size_t size) {
+    const char *err = chunk_uncompress(codec, dict, src, len, dst, size);
+    if (err) {
+        luaL_error(L, "%s", err);
+    }
+}
+
+// 一块数据在压缩数据和解压结果中的位置
+struct chunk {
+    size_t src;
+    size_t comp;
+    size_t dst;
+    size_t raw;
+};
+
+struct chunk_jobs {
+    int codec;
+    const struct dict *dict;
+    const char *src;
+    char *dst;
+    struct chunk *chunks;
+    _Atomic(const char *) err;  // 多个工作线程可能同时出错
+};
+
+static void chunk_job_decompress(void *ud, int i) {
+    struct chunk_jobs *jobs = (struct chunk_jobs *)ud;
+    struct chunk *c = &jobs->chunks[i];
+    const char *err = chunk_uncompress(jobs->codec, jobs->dict, jobs->src + c->src, c->comp, jobs->dst + c->dst, c->raw);
+    if (err)
+        atomic_store_explicit(&jobs->err, err, memory_order_relaxed);
+}
+
+static const char *decompress_chunked(lua_State *L, int codec, const struct dict *dict, int workers,
+        const char *src, size_t len, size_t *size) {
+    // 先扫一遍块头, 算出总长度后一次分配到位
+    size_t total = 0;
+    size_t pos = 0;
+    int count = 0;
+    for (;;) {
+        uint64_t raw, comp;
+        int n = chunk_header(src + pos, len - pos, &raw, &comp);
+        if (n <= 0 || comp > len - pos - n) {
+            luaL_error(L, "无效的数据帧");
+        }
+        pos += n + comp;
+        if (raw == 0)
+            break;
+        // 块头中的长度不可信, 累加前检查溢出, 超过帧头记录的总长度时立即停止.
+        // 流式写出的帧头没有总长度, 每块的原始长度不能超过压缩数据按最大压缩率能解出的长度
+        if (raw > max_decompressed(codec, (size_t)comp) || raw > SIZE_MAX - total
+                || (*size != FRAME_SIZE_UNKNOWN && total + raw > *size)) {
+            luaL_error(L, "数据长度不匹配");
+        }
+        total += raw;
+        count++;
+    }
+    if (pos != len || (*size != FRAME_SIZE_UNKNOWN && *size != total)) {
+        luaL_error(L, "数据长度不匹配");
+    }
+
+    struct scratch *s = scratch_acquire(L);
+    char *dst = scratch_reserve(s, total ? total : 1);
+    if (dst == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+
+    struct chunk_jobs jobs;
+    jobs.codec = codec;
+    jobs.dict = dict;
+    jobs.src = src;
+    jobs.dst = dst;
+    jobs.chunks = NULL;
+    atomic_init(&jobs.err, NULL);
+    if (workers > 1 && count > 1)
+        jobs.chunks = (struct chunk *)malloc(count * sizeof(struct chunk));
+
+    size_t off = 0;
+    pos = 0;
+    for (int i = 0; ; i++) {
+        uint64_t raw, comp;
+        int n = chunk_header(src + pos, len - pos, &raw, &comp);
+        if (raw == 0)
+            break;
+        if (i >= count || raw > total - off) {
+            free(jobs.chunks);
+            luaL_error(L, "无效的数据帧");
+        }
+        if (jobs.chunks) {
+            struct chunk *c = &jobs.chunks[i];
+            c->src = pos + n;
+            c->comp = comp;
+            c->dst = off;
+            c->raw = raw;
+        } else {
+            chunk_decompress(L, codec, dict, src + pos + n, comp, dst + off, raw);
+        }
+        pos += n + comp;
+        off += raw;
+    }
+    if (jobs.chunks) {
+        parallel_run(workers, count, chunk_job_decompress, &jobs);
+        free(jobs.chunks);
+        // parallel_run返回时工作线程都已结束
+        const char *err = atomic_load_explicit(&jobs.err, memory_order_relaxed);
+        if (err) {
+            luaL_error(L, "%s", err);
+        }
+    }
+    *size = total;
+    return dst;
+}
+
+static void put_uint32(char *dst, uint32_t v) {
+    dst[0] = (char)(v >> 24);
+    dst[1] = (char)(v >> 16);
+    dst[2] = (char)(v >> 8);
+    dst[3] = (char)v;
+}
+
+// 帧头: "CS" 版本号 压缩方式 标志位 原始长度(varint) 字典ID(4字节, 可选),
+// 之后是压缩数据, 可选4字节CRC32
+static size_t frame_header(char *dst, const struct options *opt, int version, int flags, size_t size,
+        const struct dict *dict) {
+    dst[0] = FRAME_MAGIC0;
+    dst[1] = FRAME_MAGIC1;
+    dst[2] = (char)version;
+    dst[3] = (char)opt->codec;
+    dst[4] = (char)(flags | (dict ? FRAME_DICT : 0));
+    size_t n = 5;
+    if (!(flags & FRAME_STREAM))
+        n += varint_encode(size, (uint8_t *)dst + 5);
+    if (dict) {
+        put_uint32(dst + n, dict->id);
+        n += 4;
+    }
+    return n;
+}
+
+static uint32_t get_uint32(const char *src) {
+    const uint8_t *p = (const uint8_t *)src;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+struct encode_jobs {
+    int codec;
+    int level;
+    const struct dict *dict;
+    int checksum;
+    const struct iovec *iov;
+    int iov_count;
+    size_t size;
+    size_t chunk_size;
+    char *out;
+    size_t stride;      // 每块的输出区域长度, 块头留在区域开头
+    size_t *comp;
+    uLong *crc;
+    _Atomic(const char *) err;  // 多个工作线程可能同时出错
+};
+
+// 压缩第i块. 各块的数据可能跨越多个数据块链节点
+static void chunk_job_compress(void *ud, int i) {
+    struct encode_jobs *jobs = (struct encode_jobs *)ud;
+    size_t begin = (size_t)i * jobs->chunk_size;
+    size_t end = begin + jobs->chunk_size;
+    if (end > jobs->size)
+        end = jobs->size;
+
+    struct iovec iov[PARALLEL_MAX_IOV];
+    int n = 0;
+    size_t off = 0;
+    for (int k = 0; k < jobs->iov_count && off < end; k++) {
+        size_t len = jobs->iov[k].iov_len;
+        if (off + len > begin) {
+            size_t from = begin > off ? begin - off : 0;
+            size_t to = end < off + len ? end - off : len;
+            iov[n].iov_base = (char *)jobs->iov[k].iov_base + from;
+            iov[n].iov_len = to - from;
+            n++;
+        }
+        off += len;
+    }
+
+    if (jobs->checksum) {
+        uLong crc = crc32(0L, Z_NULL, 0);
+        for (int k = 0; k < n; k++)
+            crc = crc32(crc, (const Bytef *)iov[k].iov_base, iov[k].iov_len);
+        jobs->crc[i] = crc;
+    }
+
+    char *dst = jobs->out + (size_t)i * jobs->stride + 2 * MAX_VARINT_SIZE;
+    size_t cap = jobs->stride - 2 * MAX_VARINT_SIZE;
+    if (jobs->codec == CODEC_SNAPPY) {
+        size_t len = cap;
+        if (snappy_compress_iov(iov, end - begin, dst, &len) != 0) {
+            atomic_store_explicit(&jobs->err, "Snappy压缩失败", memory_order_relaxed);
+            return;
+        }
+        jobs->comp[i] = len;
+    } else {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit(&zs, jobs->level) != Z_OK) {
+            atomic_store_explicit(&jobs->err, "Zlib压缩失败", memory_order_relaxed);
+            return;
+        }
+        if (jobs->dict && deflateSetDictionary(&zs, (const Bytef *)jobs->dict->data, jobs->dict->len) != Z_OK) {
+            deflateEnd(&zs);
+            atomic_store_explicit(&jobs->err, "Zlib压缩失败", memory_order_relaxed);
+            return;
+        }
+        zs.next_out = (Bytef *)dst;
+        zs.avail_out = cap;
+        int res = Z_OK;
+        for (int k = 0; k < n && res == Z_OK; k++) {
+            zs.next_in = (Bytef *)iov[k].iov_base;
+            zs.avail_in = iov[k].iov_len;
+            res = deflate(&zs, k == n - 1 ? Z_FINISH : Z_NO_FLUSH);
+        }
+        jobs->comp[i] = zs.total_out;
+        deflateEnd(&zs);
+        if (res != Z_STREAM_END) {
+            atomic_store_explicit(&jobs->err, "Zlib压缩失败", memory_order_relaxed);
+        }
+    }
+}
+
+// 数据分成固定长度的块, 多线程分别压缩后按块写出
+static void encode_parallel(struct buffer *bf, const struct options *opt, size_t chunk_size, luaL_Buffer *out) {
+    lua_State *L = bf->L;
+    size_t size = buffer_size(bf);
+    int count = (int)((size + chunk_size - 1) / chunk_size);
+
+    struct iovec iov[PARALLEL_MAX_IOV];
+    int iov_count = 0;
+    for (struct block *p = bf->head; p; p = p->next) {
+        iov[iov_count].iov_base = p->data;
+        iov[iov_count].iov_len = p->p;
+        iov_count++;
+    }
+
+    size_t bound = opt->codec == CODEC_SNAPPY ? snappy_max_compressed_length(chunk_size) : compressBound(chunk_size);
+    struct encode_jobs jobs;
+    jobs.codec = opt->codec;
+    jobs.level = opt->level;
+    jobs.dict = encode_dict(opt);
+    jobs.checksum = opt->checksum;
+    jobs.iov = iov;
+    jobs.iov_count = iov_count;
+    jobs.size = size;
+    jobs.chunk_size = chunk_size;
+    jobs.stride = 2 * MAX_VARINT_SIZE + bound;
+    jobs.out = luaL_prepbuffsize(out, count * jobs.stride + 1);
+    jobs.comp = (size_t *)malloc(count * sizeof(size_t));
+    jobs.crc = (uLong *)malloc(count * sizeof(uLong));
+    atomic_init(&jobs.err, NULL);
+    if (jobs.comp == NULL || jobs.crc == NULL) {
+        free(jobs.comp);
+        free(jobs.crc);
+        buffer_free(bf);
+        luaL_error(L, "内存分配失败");
+    }
+
+    parallel_run(opt->workers, count, chunk_job_compress, &jobs);
+    const char *err = atomic_load_explicit(&jobs.err, memory_order_relaxed);
+    if (err) {
+        free(jobs.comp);
+        free(jobs.crc);
+        buffer_free(bf);
+        luaL_error(L, "%s", err);
+    }
+
+    // 各块依次前移, 去掉区域之间的空隙
+    size_t pos = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (int i = 0; i < count; i++) {
+        size_t raw = i == count - 1 ? size - (size_t)i * chunk_size : chunk_size;
+        uint8_t header[2 * MAX_VARINT_SIZE];
+        int n = varint_encode(raw, header);
+        n += varint_encode(jobs.comp[i], header + n);
+        memcpy(jobs.out + pos, header, n);
+        memmove(jobs.out + pos + n, jobs.out + (size_t)i * jobs.stride + 2 * MAX_VARINT_SIZE, jobs.comp[i]);
+        pos += n + jobs.comp[i];
+        if (opt->checksum)
+            crc = crc32_combine(crc, jobs.crc[i], raw);
+    }
+    jobs.out[pos++] = 0;
+    luaL_addsize(out, pos);
+    free(jobs.comp);
+    free(jobs.crc);
+
+    if (opt->checksum) {
+        put_uint32(luaL_prepbuffsize(out, 4), (uint32_t)crc);
+        luaL_addsize(out, 4);
+    }
+}
+
+void codec_encode(struct buffer *bf, const struct options *opt, int version, luaL_Buffer *out) {
+    size_t size = buffer_size(bf);
+    size_t chunk_size = opt->job_size > 0 ? (size_t)opt->job_size : PARALLEL_CHUNK_SIZE;
+    int blocks = 0;
+    for (struct block *p = bf->head; p; p = p->next)
+        blocks++;
+    // Snappy和Zlib本身不支持多线程, 大数据分块并行压缩. Snappy不分块时流式解码器要读入整段数据才能解压,
+    // 所以单线程时大数据也分块写出, Snappy内部本来就按64KB分段压缩, 分块不影响压缩率
+    int chunked = opt->codec == CODEC_SNAPPY || (opt->workers > 1 && opt->codec == CODEC_ZLIB);
+    if (chunked && size >= 2 * chunk_size && blocks <= PARALLEL_MAX_IOV) {
+        char *header = luaL_prepbuffsize(out, FRAME_MAX_HEADER);
+        int flags = FRAME_CHUNKED | (opt->checksum ? FRAME_CHECKSUM : 0);
+        luaL_addsize(out, frame_header(header, opt, version, flags, size, encode_dict(opt)));
+        encode_parallel(bf, opt, chunk_size, out);
+        return;
+    }
+
+    int flags = opt->checksum ? FRAME_CHECKSUM : 0;
+    struct options copt = *opt;
+    copt.dict = encode_dict(opt);
+    char *header = luaL_prepbuffsize(out, FRAME_MAX_HEADER);
+    luaL_addsize(out, frame_header(header, opt, version, flags, buffer_size(bf), copt.dict));
+
+    codec_compress(bf, &copt, out);
+
+    if (flags & FRAME_CHECKSUM) {
+        uLong crc = crc32(0L, Z_NULL, 0);
+        for (struct block *p = bf->head; p; p = p->next)
+            crc = crc32(crc, (const Bytef *)p->data, p->p);
+        put_uint32(luaL_prepbuffsize(out, 4), (uint32_t)crc);
+        luaL_addsize(out, 4);
+    }
+}
+
+// 解析帧头, 返回帧头长度; 数据不足时返回0, 不是帧格式时返回-1
+static int frame_parse_header(lua_State *L, const char *data, size_t len, struct frame *fr) {
+    if (len >= 1 && data[0] != FRAME_MAGIC0)
+        return -1;
+    if (len >= 2 && data[1] != FRAME_MAGIC1)
+        return -1;
+    if (len < 5)
+        return 0;
+    fr->version = (uint8_t)data[2];
+    fr->codec = (uint8_t)data[3];
+    fr->flags = (uint8_t)data[4];
+    if (fr->version > FRAME_VERSION_MAX) {
+        luaL_error(L, "不支持的数据格式版本: %d", fr->version);
+    }
+    if (fr->codec > CODEC_ZSTD) {
+        luaL_error(L, "未知的压缩类型: %d", fr->codec);
+    }
+    if (fr->flags & ~FRAME_FLAGS) {
+        luaL_error(L, "不支持的数据帧标志: %d", fr->flags);
+    }
+    int n = 0;
+    fr->size = FRAME_SIZE_UNKNOWN;
+    if (!(fr->flags & FRAME_STREAM)) {
+        uint64_t size;
+        n = varint_decode((const uint8_t *)data + 5, len - 5, &size);
+        if (n == 0) {
+            if (len - 5 >= MAX_VARINT_SIZE) {
+                luaL_error(L, "无效的数据帧");
+            }
+            return 0;
+        }
+        if (size >= FRAME_SIZE_UNKNOWN) {
+            luaL_error(L, "无效的数据帧");
+        }
+        fr->size = (size_t)size;
+    }
+    n += 5;
+    fr->dict_id = 0;
+    if (fr->flags & FRAME_DICT) {
+        if (len < (size_t)n + 4)
+            return 0;
+        fr->dict_id = get_uint32(data + n);
+        n += 4;
+    }
+    return n;
+}
+
+// 取得解压数据帧需要的字典, 帧头没有字典标志时返回NULL
+static struct dict *frame_dict(lua_State *L, const struct frame *fr, struct dict *dict) {
+    if (!(fr->flags & FRAME_DICT))
+        return NULL;
+    if (dict == NULL) {
+        luaL_error(L, "缺少压缩字典");
+    }
+    if (dict->id != fr->dict_id) {
+        luaL_error(L, "压缩字典不匹配");
+    }
+    return dict;
+}
+
+// 解析整段数据的帧头和校验码, 不是帧格式时返回0
+static int frame_parse(lua_State *L, const char *data, size_t len, struct frame *fr) {
+    int n = frame_parse_header(L, data, len, fr);
+    if (n <= 0)
+        return 0;
+    fr->body = data + n;
+    fr->body_len = len - n;
+    if (fr->flags & FRAME_CHECKSUM) {
+        if (fr->body_len < 4) {
+            luaL_error(L, "无效的数据帧");
+        }
+        fr->body_len -= 4;
+        fr->checksum = get_uint32(fr->body + fr->body_len);
+    }
+    return 1;
+}
+
+const char *codec_decode(lua_State *L, const char *data, size_t len, const struct options *opt, size_t *size,
+        int *codec) {
+    struct frame fr;
+    if (!frame_parse(L, data, len, &fr)) {
+        // 没有帧头的旧数据, 使用调用者指定的压缩方式
+        *size = FRAME_SIZE_UNKNOWN;
+        *codec = opt->codec;
+        return codec_decompress(L, opt->codec, NULL, data, len, size);
+    }
+
+    *size = fr.size;
+    *codec = fr.codec;
+    struct dict *dict = frame_dict(L, &fr, opt->dict);
+    const char *res;
+    if (fr.flags & FRAME_CHUNKED)
+        res = decompress_chunked(L, fr.codec, dict, opt->workers, fr.body, fr.body_len, size);
+    else
+        res = codec_decompress(L, fr.codec, dict, fr.body, fr.body_len, size);
+    if (fr.flags & FRAME_CHECKSUM) {
+        uLong crc = crc32(crc32(0L, Z_NULL, 0), (const Bytef *)res, *size);
+        if ((uint32_t)crc != fr.checksum) {
+            luaL_error(L, "数据校验失败");
+        }
+    }
+    return res;
+}
+
+#define STREAM_HEADER 0
+#define STREAM_BODY 1
+#define STREAM_TRAILER 2
+#define STREAM_DONE 3
+
+// 流式解压状态. 输入可以任意切分, 多个数据帧首尾相接时依次解出
+struct codec_stream {
+    int codec;          // 没有帧头时使用的压缩方式
+    struct dict *dict;  // 调用者给出的字典
+    struct dict *active;    // 当前帧使用的字典
+    int state;
+    int frames;         // 已解完的帧数
+    struct frame fr;
+    char hdr[FRAME_MAX_HEADER];
+    size_t hdr_len;
+    char carry[FRAME_MAX_HEADER];   // 读帧头时多读入的正文
+    const char *carry_ptr;
+    size_t carry_len;
+    size_t produced;
+    uLong crc;
+    char trailer[4];
+    size_t trailer_len;
+    z_stream zs;
+    int zs_ready;
+    ZSTD_DCtx *dctx;
+    // Snappy和分块数据无法边收边解, 压缩数据收齐一段后整段解出
+    char *pending;
+    size_t pending_len;
+    size_t pending_cap;
+    size_t scan_pos;
+    size_t scan_left;
+    int snappy_done;
+    char chunk_hdr[2 * MAX_VARINT_SIZE];
+    size_t chunk_hdr_len;
+    size_t chunk_raw;
+    size_t chunk_comp;
+    int chunk_ready;
+    char *out;
+    size_t out_len;
+    size_t out_pos;
+    size_t out_cap;
+};
+
+struct codec_stream *codec_stream_new(const struct options *opt) {
+    struct codec_stream *cs = (struct codec_stream *)malloc(sizeof(*cs));
+    if (cs == NULL)
+        return NULL;
+    memset(cs, 0, sizeof(*cs));
+    cs->codec = opt->codec;
+    cs->dict = opt->dict;
+    cs->state = STREAM_HEADER;
+    return cs;
+}
+
+void codec_stream_free(struct codec_stream *cs) {
+    if (cs == NULL)
+        return;
+    if (cs->zs_ready)
+        inflateEnd(&cs->zs);
+    ZSTD_freeDCtx(cs->dctx);
+    free(cs->pending);
+    free(cs->out);
+    free(cs);
+}
+
+// 当前可用的输入, 先用完帧头多读入的部分
+static const char *stream_input(struct codec_stream *cs, const char **in, size_t *in_len, size_t *avail) {
+    if (cs->carry_len) {
+        *avail = cs->carry_len;
+        return cs->carry_ptr;
+    }
+    *avail = *in_len;
+    return *in;
+}
+
+static void stream_consume(struct codec_stream *cs, const char **in, size_t *in_len, size_t n) {
+    if (cs->carry_len) {
+        cs->carry_ptr += n;
+        cs->carry_len -= n;
+    } else {
+        *in += n;
+        *in_len -= n;
+    }
+}
+
+// 退回最近一次多读入的n字节
+static void stream_unconsume(struct codec_stream *cs, const char **in, size_t *in_len, int from_carry, size_t n) {
+    if (from_carry) {
+        cs->carry_ptr -= n;
+        cs->carry_len += n;
+    } else {
+        *in -= n;
+        *in_len += n;
+    }
+}
+
+static void stream_reserve(lua_State *L, char **buf, size_t *cap, size_t size) {
+    if (size <= *cap)
+        return;
+    if (size > SIZE_MAX / 2) {
+        luaL_error(L, "内存分配失败");
+    }
+    size_t want = *cap ? *cap : INITIAL_SIZE;
+    while (want < size)
+        want *= 2;
+    char *p = (char *)realloc(*buf, want);
+    if (p == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+    *buf = p;
+    *cap = want;
+}
+
+// 输出已整段解出的数据
+static size_t stream_serve(struct codec_stream *cs, char *dst, size_t cap) {
+    size_t take = cs->out_len - cs->out_pos;
+    if (take > cap)
+        take = cap;
+    memcpy(dst, cs->out + cs->out_pos, take);
+    cs->out_pos += take;
+    return take;
+}
+
+static int stream_last(struct codec_stream *cs, size_t in_len, int eof) {
+    return eof && cs->carry_len == 0 && in_len == 0;
+}
+
+static void stream_begin(lua_State *L, struct codec_stream *cs) {
+    cs->produced = 0;
+    cs->crc = crc32(0L, Z_NULL, 0);
+    cs->trailer_len = 0;
+    cs->pending_len = 0;
+    cs->scan_pos = 0;
+    cs->snappy_done = 0;
+    cs->chunk_hdr_len = 0;
+    cs->chunk_ready = 0;
+    cs->out_len = cs->out_pos = 0;
+    cs->active = frame_dict(L, &cs->fr, cs->dict);
+    // 分块数据每块单独解压, 不需要流式上下文
+    if (cs->fr.flags & FRAME_CHUNKED)
+        return;
+    switch (cs->fr.codec) {
+    case CODEC_ZLIB:
+        if (!cs->zs_ready) {
+            if (inflateInit(&cs->zs) != Z_OK) {
+                luaL_error(L, "Zlib解压失败");
+            }
+            cs->zs_ready = 1;
+        } else {
+            inflateReset(&cs->zs);
+        }
+        break;
+    case CODEC_ZSTD:
+        if (cs->dctx == NULL) {
+            cs->dctx = ZSTD_createDCtx();
+            if (cs->dctx == NULL) {
+                luaL_error(L, "内存分配失败");
+            }
+        } else {
+            ZSTD_DCtx_reset(cs->dctx, ZSTD_reset_session_only);
+        }
+        ZSTD_DDict *ddict = cs->active ? dict_ddict(cs->active) : NULL;
+        if ((cs->active && ddict == NULL) || ZSTD_isError(ZSTD_DCtx_refDDict(cs->dctx, ddict))) {
+            luaL_error(L, "内存分配失败");
+        }
+        break;
+    }
+}
+
+// Snappy的压缩数据本身不记长度, 逐个跳过字面量和复制元素, 直到凑够原始长度, 由此找到压缩数据的结尾
+static int snappy_scan(lua_State *L, struct codec_stream *cs) {
+    const uint8_t *p = (const uint8_t *)cs->pending;
+    size_t len = cs->pending_len;
+    size_t pos = cs->scan_pos;
+    if (pos == 0) {
+        uint64_t size;
+        int n = varint_decode(p, len, &size);
+        if (n == 0) {
+            if (len >= 5) {
+                luaL_error(L, "无法获取Snappy解压后的长度");
+            }
+            return 0;
+        }
+        if (cs->fr.size != FRAME_SIZE_UNKNOWN && cs->fr.size != size) {
+            luaL_error(L, "无法获取Snappy解压后的长度");
+        }
+        cs->scan_left = (size_t)size;
+        pos = n;
+    }
+    while (cs->scan_left > 0 && pos < len) {
+        uint8_t tag = p[pos];
+        size_t head, body = 0, out;
+        switch (tag & 3) {
+        case 0: {
+            // 字面量, 长度超过60时后跟1~4字节的长度
+            size_t n = tag >> 2;
+            head = 1;
+            if (n >= 60) {
+                int extra = (int)n - 59;
+                head += extra;
+                if (pos + head > len)
+                    goto wait;
+                n = 0;
+                for (int i = 0; i < extra; i++)
+                    n |= (size_t)p[pos + 1 + i] << (8 * i);
+            }
+            out = body = n + 1;
+            break;
+        }
+        case 1:
+            head = 2;
+            out = 4 + ((tag >> 2) & 7);
+            break;
+        case 2:
+            head = 3;
+            out = (tag >> 2) + 1;
+            break;
+        default:
+            head = 5;
+            out = (tag >> 2) + 1;
+            break;
+        }
+        if (pos + head + body > len)
+            break;
+        if (out > cs->scan_left) {
+            luaL_error(L, "Snappy解压失败");
+        }
+        cs->scan_left -= out;
+        pos += head + body;
+    }
+wait:
+    cs->scan_pos = pos;
+    return cs->scan_left == 0;
+}
+
+static size_t stream_snappy(lua_State *L, struct codec_stream *cs, const char **in, size_t *in_len,
+        char *dst, size_t cap, int *end) {
+    if (!cs->snappy_done) {
+        size_t avail;
+        const char *src = stream_input(cs, in, in_len, &avail);
+        int from_carry = cs->carry_len != 0;
+        stream_reserve(L, &cs->pending, &cs->pending_cap, cs->pending_len + avail);
+        if (avail) {
+            memcpy(cs->pending + cs->pending_len, src, avail);
+            cs->pending_len += avail;
+            stream_consume(cs, in, in_len, avail);
+        }
+        if (!snappy_scan(L, cs))
+            return 0;
+
+        // 压缩数据之后的部分属于帧尾或下一帧, 退回输入
+        stream_unconsume(cs, in, in_len, from_carry, cs->pending_len - cs->scan_pos);
+        size_t size;
+        if (snappy_uncompressed_length(cs->pending, cs->scan_pos, &size) != SNAPPY_OK) {
+            luaL_error(L, "无法获取Snappy解压后的长度");
+        }
+        stream_reserve(L, &cs->out, &cs->out_cap, size);
+        if (snappy_uncompress(cs->pending, cs->scan_pos, cs->out, &size) != SNAPPY_OK) {
+            luaL_error(L, "Snappy解压失败");
+        }
+        cs->pending_len = 0;
+        cs->out_len = size;
+        cs->out_pos = 0;
+        cs->snappy_done = 1;
+    }
+
+    size_t take = stream_serve(cs, dst, cap);
+    if (cs->out_pos == cs->out_len)
+        *end = 1;
+    return take;
+}
+
+static size_t stream_chunked(lua_State *L, struct codec_stream *cs, const char **in, size_t *in_len,
+        char *dst, size_t cap, int *end) {
+    for (;;) {
+        if (cs->out_pos < cs->out_len)
+            return stream_serve(cs, dst, cap);
+
+        size_t avail;
+        const char *src = stream_input(cs, in, in_len, &avail);
+        int from_carry = cs->carry_len != 0;
+        if (!cs->chunk_ready) {
+            size_t take = sizeof(cs->chunk_hdr) - cs->chunk_hdr_len;
+            if (take > avail)
+                take = avail;
+            if (take) {
+                memcpy(cs->chunk_hdr + cs->chunk_hdr_len, src, take);
+                cs->chunk_hdr_len += take;
+                stream_consume(cs, in, in_len, take);
+            }
+            uint64_t raw, comp;
+            int n = chunk_header(cs->chunk_hdr, cs->chunk_hdr_len, &raw, &comp);
+            if (n < 0) {
+                luaL_error(L, "无效的数据帧");
+            }
+            if (n == 0)
+                return 0;
+            stream_unconsume(cs, in, in_len, from_carry, cs->chunk_hdr_len - n);
+            cs->chunk_hdr_len = 0;
+            if (raw == 0) {
+                *end = 1;
+                return 0;
+            }
+            if (raw > max_decompressed(cs->fr.codec, (size_t)comp)) {
+                luaL_error(L, "数据长度不匹配");
+            }
+            cs->chunk_raw = (size_t)raw;
+            cs->chunk_comp = (size_t)comp;
+            cs->pending_len = 0;
+            cs->chunk_ready = 1;
+            stream_reserve(L, &cs->pending, &cs->pending_cap, cs->chunk_comp);
+            src = stream_input(cs, in, in_len, &avail);
+        }
+
+        size_t take = cs->chunk_comp - cs->pending_len;
+        if (take > avail)
+            take = avail;
+        if (take) {
+            memcpy(cs->pending + cs->pending_len, src, take);
+            cs->pending_len += take;
+            stream_consume(cs, in, in_len, take);
+        }
+        if (cs->pending_len < cs->chunk_comp)
+            return 0;
+
+        stream_reserve(L, &cs->out, &cs->out_cap, cs->chunk_raw);
+        chunk_decompress(L, cs->fr.codec, cs->active, cs->pending, cs->chunk_comp, cs->out, cs->chunk_raw);
+        cs->out_len = cs->chunk_raw;
+        cs->out_pos = 0;
+        cs->chunk_ready = 0;
+    }
+}
+
+static size_t stream_body(lua_State *L, struct codec_stream *cs, const char **in, size_t *in_len, int eof,
+        char *dst, size_t cap, int *end) {
+    if (cs->fr.flags & FRAME_CHUNKED)
+        return stream_chunked(L, cs, in, in_len, dst, cap, end);
+    size_t avail;
+    const char *src = stream_input(cs, in, in_len, &avail);
+    switch (cs->fr.codec) {
+    case CODEC_SNAPPY:
+        return stream_snappy(L, cs, in, in_len, dst, cap, end);
+    case CODEC_ZLIB: {
+        if (avail > UINT_MAX)
+            avail = UINT_MAX;
+        if (cap > UINT_MAX)
+            cap = UINT_MAX;
+        cs->zs.next_in = (Bytef *)src;
+        cs->zs.avail_in = avail;
+        cs->zs.next_out = (Bytef *)dst;
+        cs->zs.avail_out = cap;
+        int res = inflate(&cs->zs, Z_NO_FLUSH);
+        if (res == Z_NEED_DICT && cs->active
+                && inflateSetDictionary(&cs->zs, (const Bytef *)cs->active->data, cs->active->len) == Z_OK)
+            res = Z_OK;
+        if (res == Z_STREAM_END) {
+            *end = 1;
+        } else if (res != Z_OK && res != Z_BUF_ERROR) {
+            luaL_error(L, "Zlib解压失败");
+        }
+        stream_consume(cs, in, in_len, avail - cs->zs.avail_in);
+        return cap - cs->zs.avail_out;
+    }
+    case CODEC_ZSTD: {
+        ZSTD_inBuffer input = { src, avail, 0 };
+        ZSTD_outBuffer output = { dst, cap, 0 };
+        size_t res = ZSTD_decompressStream(cs->dctx, &output, &input);
+        if (ZSTD_isError(res)) {
+            luaL_error(L, "Zstd解压失败: %s", ZSTD_getErrorName(res));
+        }
+        if (res == 0)
+            *end = 1;
+        stream_consume(cs, in, in_len, input.pos);
+        return output.pos;
+    }
+    default: {
+        size_t take = avail < cap ? avail : cap;
+        if (cs->fr.size != FRAME_SIZE_UNKNOWN && take > cs->fr.size - cs->produced)
+            take = cs->fr.size - cs->produced;
+        if (take) {
+            memcpy(dst, src, take);
+            stream_consume(cs, in, in_len, take);
+        }
+        if (cs->fr.size != FRAME_SIZE_UNKNOWN)
+            *end = cs->produced + take == cs->fr.size;
+        else
+            *end = stream_last(cs, *in_len, eof);
+        return take;
+    }
+    }
+}
+
+size_t codec_stream_read(lua_State *L, struct codec_stream *cs, const char **in, size_t *in_len, int eof,
+        char *dst, size_t cap) {
+    size_t n = 0;
+    for (;;) {
+        switch (cs->state) {
+        case STREAM_HEADER: {
+            size_t avail;
+            const char *src = stream_input(cs, in, in_len, &avail);
+            size_t take = FRAME_MAX_HEADER - cs->hdr_len;
+            if (take > avail)
+                take = avail;
+            if (take) {
+                memcpy(cs->hdr + cs->hdr_len, src, take);
+                cs->hdr_len += take;
+                stream_consume(cs, in, in_len, take);
+            }
+            if (cs->hdr_len == 0)
+                return n;
+            int res = frame_parse_header(L, cs->hdr, cs->hdr_len, &cs->fr);
+            if (res == 0 && !stream_last(cs, *in_len, eof)) {
+                if (cs->carry_len == 0 && *in_len == 0)
+                    return n;
+                continue;
+            }
+            if (res > 0) {
+                // 帧头之后多读入的部分留作正文
+                cs->carry_len = cs->hdr_len - res;
+                memcpy(cs->carry, cs->hdr + res, cs->carry_len);
+            } else {
+                if (cs->frames > 0) {
+                    luaL_error(L, "无效的数据帧");
+                }
+                if (res == 0 && cs->hdr_len >= 2) {
+                    luaL_error(L, "数据不完整");
+                }
+                // 没有帧头的旧数据, 整段都是正文
+                cs->fr.version = 0;
+                cs->fr.codec = cs->codec;
+                cs->fr.flags = 0;
+                cs->fr.size = FRAME_SIZE_UNKNOWN;
+                cs->fr.dict_id = 0;
+                cs->carry_len = cs->hdr_len;
+                memcpy(cs->carry, cs->hdr, cs->carry_len);
+            }
+            cs->carry_ptr = cs->carry;
+            cs->hdr_len = 0;
+            stream_begin(L, cs);
+            cs->state = STREAM_BODY;
+            break;
+        }
+        case STREAM_BODY: {
+            int end = 0;
+            size_t got = stream_body(L, cs, in, in_len, eof, dst + n, cap - n, &end);
+            if (cs->fr.flags & FRAME_CHECKSUM)
+                cs->crc = crc32(cs->crc, (const Bytef *)dst + n, got);
+            cs->produced += got;
+            n += got;
+            if (end) {
+                if (cs->fr.size != FRAME_SIZE_UNKNOWN && cs->produced != cs->fr.size) {
+                    luaL_error(L, "数据长度不匹配");
+                }
+                cs->state = STREAM_TRAILER;
+                break;
+            }
+            if (n == cap)
+                return n;
+            if (cs->carry_len == 0 && *in_len == 0) {
+                if (eof) {
+                    luaL_error(L, "数据不完整");
+                }
+                return n;
+            }
+            break;
+        }
+        case STREAM_TRAILER: {
+            if (cs->fr.flags & FRAME_CHECKSUM) {
+                while (cs->trailer_len < 4) {
+                    size_t avail;
+                    const char *src = stream_input(cs, in, in_len, &avail);
+                    if (avail == 0) {
+                        if (eof) {
+                            luaL_error(L, "数据不完整");
+                        }
+                        return n;
+                    }
+                    size_t take = 4 - cs->trailer_len;
+                    if (take > avail)
+                        take = avail;
+                    memcpy(cs->trailer + cs->trailer_len, src, take);
+                    cs->trailer_len += take;
+                    stream_consume(cs, in, in_len, take);
+                }
+                if (get_uint32(cs->trailer) != (uint32_t)cs->crc) {
+                    luaL_error(L, "数据校验失败");
+                }
+            }
+            cs->frames++;
+            cs->state = STREAM_DONE;
+            break;
+        }
+        default:
+            if (cs->carry_len == 0 && *in_len == 0)
+                return n;
+            // 后面还有数据, 接着解下一帧
+            cs->state = STREAM_HEADER;
+            break;
+        }
+    }
+}
+
+#define WRITER_OUT_SIZE (64 * 1024)
+
+// 流式压缩状态. Zlib和Zstd整个数据帧是一个压缩流, Snappy和不压缩时按块写出
+struct codec_writer {
+    int codec;
+    int flags;
+    uLong crc;
+    z_stream zs;
+    int zs_ready;
+    ZSTD_CCtx *cctx;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    codec_output output;
+    void *ud;
+};
+
+// 释放创建到一半的写出器后报错, luaL_error不会返回
+static void writer_fail(lua_State *L, struct codec_writer *w, const char *msg) {
+    codec_writer_free(w);
+    luaL_error(L, "%s", msg);
+}
+
+struct codec_writer *codec_writer_new(lua_State *L, const struct options *opt, codec_output output, void *ud) {
+    struct dict *dict = encode_dict(opt);
+    struct codec_writer *w = (struct codec_writer *)malloc(sizeof(*w));
+    if (w == NULL)
+        luaL_error(L, "内存分配失败");
+    memset(w, 0, sizeof(*w));
+    w->codec = opt->codec;
+    w->flags = FRAME_STREAM | (opt->checksum ? FRAME_CHECKSUM : 0);
+    w->crc = crc32(0L, Z_NULL, 0);
+    w->output = output;
+    w->ud = ud;
+    w->out = (char *)malloc(WRITER_OUT_SIZE);
+    if (w->out == NULL)
+        writer_fail(L, w, "内存分配失败");
+    w->out_cap = WRITER_OUT_SIZE;
+
+    switch (w->codec) {
+    case CODEC_ZLIB:
+        if (deflateInit(&w->zs, opt->level) != Z_OK)
+            writer_fail(L, w, "内存分配失败");
+        w->zs_ready = 1;
+        if (dict && deflateSetDictionary(&w->zs, (const Bytef *)dict->data, dict->len) != Z_OK)
+            writer_fail(L, w, "Zlib字典设置失败");
+        break;
+    case CODEC_ZSTD:
+        w->cctx = ZSTD_createCCtx();
+        if (w->cctx == NULL)
+            writer_fail(L, w, "内存分配失败");
+        ZSTD_CCtx_setParameter(w->cctx, ZSTD_c_compressionLevel, opt->level);
+        // 编码器存活期间字典的预处理结果可能因别处换了压缩级别而重建, 这里复制一份由压缩上下文自己持有
+        if (dict && ZSTD_isError(ZSTD_CCtx_loadDictionary(w->cctx, dict->data, dict->len)))
+            writer_fail(L, w, "Zstd字典设置失败");
+        zstd_workers(w->cctx, opt, FRAME_SIZE_UNKNOWN);
+        break;
+    default:
+        w->flags |= FRAME_CHUNKED;
+        break;
+    }
+    // 帧头先于正文写出, 之后每次write都可能写出函数表标记, 取可能用到的最高版本
+    w->out_len = frame_header(w->out, opt, FRAME_VERSION_FUNCTIONS, w->flags, 0, dict);
+    return w;
+}
+
+void codec_writer_free(struct codec_writer *w) {
+    if (w == NULL)
+        return;
+    if (w->zs_ready)
+        deflateEnd(&w->zs);
+    ZSTD_freeCCtx(w->cctx);
+    free(w->out);
+    free(w);
+}
+
+static void writer_drain(struct codec_writer *w) {
+    if (w->out_len == 0)
+        return;
+    size_t len = w->out_len;
+    w->out_len = 0;
+    w->output(w->ud, w->out, len);
+}
+
+// 整段压缩成一块: 原始长度 压缩长度 压缩数据
+static void writer_chunk(lua_State *L, struct codec_writer *w, struct buffer *bf, size_t size) {
+    size_t bound = w->codec == CODEC_SNAPPY ? snappy_max_compressed_length(size) : size;
+    size_t need = 2 * MAX_VARINT_SIZE + bound;
+    if (w->out_len + need > w->out_cap) {
+        writer_drain(w);
+        if (need > w->out_cap) {
+            char *out = (char *)realloc(w->out, need);
+            if (out == NULL) {
+                luaL_error(L, "内存分配失败");
+            }
+            w->out = out;
+            w->out_cap = need;
+        }
+    }
+
+    // 先压缩到块头最大长度之后, 写好块头再把数据挪过去
+    char *data = w->out + w->out_len + 2 * MAX_VARINT_SIZE;
+    size_t len = bound;
+    if (w->codec == CODEC_SNAPPY) {
+        struct iovec iov[MAX_STACK_IOV];
+        struct iovec *piov = iov;
+        int count = 0;
+        for (struct block *p = bf->head; p && p->p > 0; p = p->next)
+            count++;
+        if (count > MAX_STACK_IOV) {
+            piov = (struct iovec *)malloc(count * sizeof(struct iovec));
+            if (piov == NULL) {
+                luaL_error(L, "内存分配失败");
+            }
+        }
+        int i = 0;
+        for (struct block *p = bf->head; p && p->p > 0; p = p->next, i++) {
+            piov[i].iov_base = p->data;
+            piov[i].iov_len = p->p;
+        }
+        int res = snappy_compress_iov(piov, size, data, &len);
+        if (piov != iov)
+            free(piov);
+        if (res != 0) {
+            luaL_error(L, "Snappy压缩失败");
+        }
+    } else {
+        char *dst = data;
+        for (struct block *p = bf->head; p && p->p > 0; p = p->next) {
+            memcpy(dst, p->data, p->p);
+            dst += p->p;
+        }
+    }
+
+    uint8_t header[2 * MAX_VARINT_SIZE];
+    int n = varint_encode(size, header);
+    n += varint_encode(len, header + n);
+    char *dst = w->out + w->out_len;
+    memcpy(dst, header, n);
+    memmove(dst + n, data, len);
+    w->out_len += n + len;
+}
+
+static void writer_deflate(lua_State *L, struct codec_writer *w, const char *data, size_t len, int flush) {
+    w->zs.next_in = (Bytef *)data;
+    w->zs.avail_in = len;
+    for (;;) {
+        if (w->out_len == w->out_cap)
+            writer_drain(w);
+        w->zs.next_out = (Bytef *)w->out + w->out_len;
+        w->zs.avail_out = w->out_cap - w->out_len;
+        int res = deflate(&w->zs, flush);
+        if (res == Z_STREAM_ERROR) {
+            luaL_error(L, "Zlib压缩失败");
+        }
+        w->out_len = w->out_cap - w->zs.avail_out;
+        if (flush == Z_FINISH ? res == Z_STREAM_END : w->zs.avail_in == 0 && w->zs.avail_out != 0)
+            break;
+    }
+}
+
+static void writer_zstd(lua_State *L, struct codec_writer *w, const char *data, size_t len, ZSTD_EndDirective mode) {
+    ZSTD_inBuffer input = { data, len, 0 };
+    for (;;) {
+        if (w->out_len == w->out_cap)
+            writer_drain(w);
+        ZSTD_outBuffer output = { w->out, w->out_cap, w->out_len };
+        size_t res = ZSTD_compressStream2(w->cctx, &output, &input, mode);
+        if (ZSTD_isError(res)) {
+            luaL_error(L, "Zstd压缩失败: %s", ZSTD_getErrorName(res));
+        }
+        w->out_len = output.pos;
+        if (mode == ZSTD_e_continue ? input.pos == input.size : res == 0)
+            break;
+    }
+}
+
+void codec_writer_write(lua_State *L, struct codec_writer *w, struct buffer *bf) {
+    size_t size = buffer_size(bf);
+    if (size == 0)
+        return;
+    if (w->flags & FRAME_CHECKSUM) {
+        for (struct block *p = bf->head; p && p->p > 0; p = p->next)
+            w->crc = crc32(w->crc, (const Bytef *)p->data, p->p);
+    }
+    if (w->flags & FRAME_CHUNKED) {
+        writer_chunk(L, w, bf, size);
+        return;
+    }
+    for (struct block *p = bf->head; p && p->p > 0; p = p->next) {
+        if (w->codec == CODEC_ZLIB)
+            writer_deflate(L, w, p->data, p->p, Z_NO_FLUSH);
+        else
+            writer_zstd(L, w, p->data, p->p, ZSTD_e_continue);
+    }
+}
+
+void codec_writer_flush(lua_State *L, struct codec_writer *w, int end) {
+    if (w->flags & FRAME_CHUNKED) {
+        if (end) {
+            if (w->out_len == w->out_cap)
+                writer_drain(w);
+            w->out[w->out_len++] = 0;
+        }
+    } else if (w->codec == CODEC_ZLIB) {
+        writer_deflate(L, w, NULL, 0, end ? Z_FINISH : Z_SYNC_FLUSH);
+    } else {
+        writer_zstd(L, w, NULL, 0, end ? ZSTD_e_end : ZSTD_e_flush);
+    }
+    if (end && (w->flags & FRAME_CHECKSUM)) {
+        if (w->out_len + 4 > w->out_cap)
+            writer_drain(w);
+        put_uint32(w->out + w->out_len, (uint32_t)w->crc);
+        w->out_len += 4;
+    }
+    writer_drain(w);
+}
@@ -0,0 +1,76 @@
+#ifndef _CODEC_H_
+#define _CODEC_H_
+
+#include <stdint.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include "buffer.h"
+
+#define CODEC_NONE 0
+#define CODEC_SNAPPY 1
+#define CODEC_ZLIB 2
+#define CODEC_ZSTD 3
+
+#define FRAME_MAGIC0 'C'
+#define FRAME_MAGIC1 'S'
+#define FRAME_VERSION 1
+#define FRAME_VERSION_VARINT 2  // 正文中有varint整数或紧密排列的数组, 旧版本无法解析
+#define FRAME_VERSION_FUNCTIONS 3   // 正文中有函数表标记, 重复的函数写成序号
+#define FRAME_VERSION_MAX FRAME_VERSION_FUNCTIONS
+#define FRAME_MAX_HEADER 19
+#define FRAME_SIZE_UNKNOWN ((size_t)-1)
+
+// 帧标志位
+#define FRAME_CHECKSUM 0x01
+#define FRAME_STREAM 0x02   // 流式写出, 帧头不含原始长度
+#define FRAME_CHUNKED 0x04  // 正文分块压缩: 原始长度(varint) 压缩长度(varint) 压缩数据, 以原始长度0结尾
+#define FRAME_DICT 0x08     // 使用了压缩字典, 帧头末尾带4字节字典ID
+#define FRAME_FLAGS (FRAME_CHECKSUM | FRAME_STREAM | FRAME_CHUNKED | FRAME_DICT)
+
+struct frame {
+    int version;
+    int codec;
+    int flags;
+    size_t size;
+    uint32_t dict_id;
+    const char *body;
+    size_t body_len;
+    uint32_t checksum;
+};
+
+struct iovec;
+struct options;
+
+int codec_from_name(const char *name);
+void codec_check_level(lua_State *L, int codec, int level);
+// version为正文要求的数据帧版本
+void codec_encode(struct buffer *bf, const struct options *opt, int version, luaL_Buffer *out);
+// 没有帧头的数据按opt->codec解压, 分块数据用opt->workers个线程解压, 使用了字典的数据需要opt->dict.
+// 解压结果位于原字符串或复用的解压缓冲区中; 缓冲区对象(或nil)压在栈顶, 解析完后用codec_release归还.
+// codec返回实际使用的压缩方式
+const char *codec_decode(lua_State *L, const char *data, size_t len, const struct options *opt, size_t *size,
+        int *codec);
+void codec_release(lua_State *L, int index);
+
+// 流式解压: 压缩数据可分多次送入, 每次最多解出cap字节, 输入耗尽或dst写满时返回.
+// eof表示输入已全部送入, 此时会检查数据是否完整. opt中的字典在解压期间需要保持存活
+struct codec_stream;
+struct codec_stream *codec_stream_new(const struct options *opt);
+void codec_stream_free(struct codec_stream *cs);
+size_t codec_stream_read(lua_State *L, struct codec_stream *cs, const char **in, size_t *in_len, int eof,
+        char *dst, size_t cap);
+
+// 流式压缩: 数据块链逐段送入压缩器, 压缩结果攒够一定长度就交给output
+struct codec_writer;
+typedef void (*codec_output)(void *ud, const char *data, size_t len);
+// 创建失败时在L上报错, 不返回NULL
+struct codec_writer *codec_writer_new(lua_State *L, const struct options *opt, codec_output output, void *ud);
+void codec_writer_free(struct codec_writer *w);
+void codec_writer_write(lua_State *L, struct codec_writer *w, struct buffer *bf);
+// 把已送入的数据全部输出; end为1时结束数据帧
+void codec_writer_flush(lua_State *L, struct codec_writer *w, int end);
+
+// snappy_iovec.cc
+int snappy_compress_iov(const struct iovec *iov, size_t input_length, char *compressed, size_t *compressed_length);
+
+#endif //_CODEC_H_
@@ -2,11 +2,70 @@
 
 #if LUA_VERSION_NUM < 502
 #define lua_rawlen lua_objlen
+
+// Lua 5.1的luaL_Buffer一次只能预留LUAL_BUFFERSIZE字节, 压缩结果要直接写进去,
+// 换成和5.2以上一样的可增长缓冲区: 超出内置空间后内容放在栈顶的userdata里, 增长时换成更大的
+#include <string.h>
+
+typedef struct compat_buffer {
+    char *b;
+    size_t size;
+    size_t n;
+    lua_State *L;
+    char init[LUAL_BUFFERSIZE];
+} compat_buffer;
+
+static inline void
+compat_buffinit(lua_State *L, compat_buffer *B) {
+    B->b = B->init;
+    B->size = LUAL_BUFFERSIZE;
+    B->n = 0;
+    B->L = L;
+}
+
+static inline char *
+compat_prepbuffsize(compat_buffer *B, size_t sz) {
+    if (B->size - B->n >= sz)
+        return B->b + B->n;
+    size_t size = B->size * 2;
+    if (size - B->n < sz)
+        size = B->n + sz;
+    char *box = (char *)lua_newuserdata(B->L, size);
+    memcpy(box, B->b, B->n);
+    if (B->b != B->init)
+        lua_replace(B->L, -2);
+    B->b = box;
+    B->size = size;
+    return box + B->n;
+}
+
+static inline void
+compat_addlstring(compat_buffer *B, const char *s, size_t l) {
+    memcpy(compat_prepbuffsize(B, l), s, l);
+    B->n += l;
+}
+
+static inline void
+compat_pushresult(compat_buffer *B) {
+    lua_pushlstring(B->L, B->b, B->n);
+    if (B->b != B->init)
+        lua_remove(B->L, -2);
+}
+
+#undef luaL_addchar
+#undef luaL_addsize
+#define luaL_Buffer compat_buffer
+#define luaL_buffinit compat_buffinit
+#define luaL_prepbuffsize compat_prepbuffsize
+#define luaL_addlstring compat_addlstring
+#define luaL_pushresult compat_pushresult
+#define luaL_addsize(B,s) ((B)->n += (s))
+#define luaL_addchar(B,c) ((void)((B)->n < (B)->size || compat_prepbuffsize((B), 1)), ((B)->b[(B)->n++] = (c)))
 #endif
 
 #if LUA_VERSION_NUM < 503
 
-static int
+static inline int
 lua_isinteger(lua_State *L, int index) {
     int32_t x = (int32_t)lua_tointeger(L,index);
     lua_Number n = lua_tonumber(L,index);
@@ -14,3 +73,31 @@ lua_isinteger(lua_State *L, int index) {
 }
 
 #endif
+
+// LEB128 无符号变长整数, 最多10字节
+#define MAX_VARINT_SIZE 10
+
+static inline int
+varint_encode(uint64_t v, uint8_t *buf) {
+    int n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    return n;
+}
+
+// 返回读取的字节数, 数据不完整或溢出时返回0
+static inline int
+varint_decode(const uint8_t *p, size_t len, uint64_t *v) {
+    uint64_t res = 0;
+    for (int i = 0; i < MAX_VARINT_SIZE && (size_t)i < len; ++i) {
+        res |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = res;
+            return i + 1;
+        }
+    }
+    return 0;
+}
@@ -4,12 +4,32 @@
 int to_bin(lua_State *L);
 int from_bin(lua_State *L);
 int to_txt(lua_State *L);
+int from_txt(lua_State *L);
+int options_new(lua_State *L);
+int decoder_new(lua_State *L);
+int encoder_new(lua_State *L);
+int cseri_train_dict(lua_State *L);
+int dict_new(lua_State *L);
+int schema_new(lua_State *L);
+int stats_get(lua_State *L);
+int stats_reset(lua_State *L);
+int cseri_profile(lua_State *L);
 
 LUALIB_API int luaopen_cseri(lua_State *L) {
     luaL_Reg l[] = {
         {"tobin", to_bin},
         {"frombin", from_bin},
         {"totxt", to_txt},
+        {"fromtxt", from_txt},
+        {"options", options_new},
+        {"decoder", decoder_new},
+        {"encoder", encoder_new},
+        {"train_dict", cseri_train_dict},
+        {"dict", dict_new},
+        {"schema", schema_new},
+        {"stats", stats_get},
+        {"stats_reset", stats_reset},
+        {"profile", cseri_profile},
         {NULL, NULL}
     };
 #if LUA_VERSION_NUM < 502
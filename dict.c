@@ -0,0 +1,101 @@
+#include <lauxlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <zdict.h>
+#include "dict.h"
+
+static int dict_gc(lua_State *L) {
+    struct dict *d = (struct dict *)lua_touserdata(L, 1);
+    ZSTD_freeCDict(d->cdict);
+    ZSTD_freeDDict(d->ddict);
+    free(d->data);
+    memset(d, 0, sizeof(*d));
+    return 0;
+}
+
+// d:dump() 返回字典内容, 保存后可以用cseri.dict重新载入
+static int dict_dump(lua_State *L) {
+    struct dict *d = (struct dict *)luaL_checkudata(L, 1, DICT_META);
+    lua_pushlstring(L, d->data, d->len);
+    return 1;
+}
+
+// 先创建好对象再填入内容, 之后出错时内容随对象一起回收
+static struct dict *dict_push(lua_State *L) {
+    struct dict *d = (struct dict *)lua_newuserdata(L, sizeof(*d));
+    memset(d, 0, sizeof(*d));
+    if (luaL_newmetatable(L, DICT_META)) {
+        lua_pushcfunction(L, dict_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_newtable(L);
+        lua_pushcfunction(L, dict_dump);
+        lua_setfield(L, -2, "dump");
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    return d;
+}
+
+static void dict_set_id(struct dict *d) {
+    d->id = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)d->data, d->len);
+}
+
+struct dict *dict_test(lua_State *L, int index) {
+    void *p = lua_touserdata(L, index);
+    if (p == NULL || lua_type(L, index) != LUA_TUSERDATA)
+        return NULL;
+    if (!lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, DICT_META);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? (struct dict *)p : NULL;
+}
+
+void dict_train(lua_State *L, const char *samples, const size_t *sizes, unsigned count, size_t capacity) {
+    struct dict *d = dict_push(L);
+    d->data = (char *)malloc(capacity);
+    if (d->data == NULL) {
+        luaL_error(L, "内存分配失败");
+    }
+    size_t res = ZDICT_trainFromBuffer(d->data, capacity, samples, sizes, count);
+    if (ZDICT_isError(res)) {
+        luaL_error(L, "字典训练失败: %s", ZDICT_getErrorName(res));
+    }
+    d->len = res;
+    dict_set_id(d);
+}
+
+ZSTD_CDict *dict_cdict(struct dict *d, int level) {
+    if (d->cdict && d->cdict_level == level)
+        return d->cdict;
+    ZSTD_freeCDict(d->cdict);
+    d->cdict = ZSTD_createCDict(d->data, d->len, level);
+    d->cdict_level = level;
+    return d->cdict;
+}
+
+ZSTD_DDict *dict_ddict(struct dict *d) {
+    if (d->ddict == NULL)
+        d->ddict = ZSTD_createDDict(d->data, d->len);
+    return d->ddict;
+}
+
+// cseri.dict(data) 载入dump保存的字典, 也可以直接用一段典型数据作为字典
+int dict_new(lua_State *L) {
+    size_t len;
+    const char *data = luaL_checklstring(L, 1, &len);
+    if (len == 0) {
+        return luaL_error(L, "字典不能为空");
+    }
+    struct dict *d = dict_push(L);
+    d->data = (char *)malloc(len);
+    if (d->data == NULL) {
+        return luaL_error(L, "内存分配失败");
+    }
+    memcpy(d->data, data, len);
+    d->len = len;
+    dict_set_id(d);
+    return 1;
+}
@@ -0,0 +1,29 @@
+#ifndef _DICT_H_
+#define _DICT_H_
+
+#include <stdint.h>
+#include <lua.h>
+#include <zstd.h>
+
+#define DICT_META "cseri.dict"
+#define DICT_DEFAULT_SIZE (110 * 1024)  // Zstd建议的字典长度
+
+// cseri.train_dict/cseri.dict 创建的压缩字典, Zstd和Zlib共用同一份字典内容
+struct dict {
+    char *data;
+    size_t len;
+    uint32_t id;            // 字典内容的CRC32, 写在帧头里用于核对解压时的字典
+    ZSTD_CDict *cdict;      // 按压缩级别预处理好的字典, 级别变化时重建
+    int cdict_level;
+    ZSTD_DDict *ddict;
+};
+
+struct dict *dict_test(lua_State *L, int index);
+// 用连续存放的样本训练字典, 结果压入栈顶
+void dict_train(lua_State *L, const char *samples, const size_t *sizes, unsigned count, size_t capacity);
+// 取得预处理好的Zstd字典, 失败时返回NULL
+ZSTD_CDict *dict_cdict(struct dict *d, int level);
+ZSTD_DDict *dict_ddict(struct dict *d);
+int dict_new(lua_State *L);
+
+#endif //_DICT_H_
@@ -0,0 +1,420 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "number.h"
+
+static const char digit_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static inline int
+count_digits(uint64_t v) {
+    int n = 1;
+    for (;;) {
+        if (v < 10) return n;
+        if (v < 100) return n + 1;
+        if (v < 1000) return n + 2;
+        if (v < 10000) return n + 3;
+        v /= 10000;
+        n += 4;
+    }
+}
+
+// 从end往前写, 每次除以100取两位查表
+static inline void
+write_digits(char *end, uint64_t v) {
+    while (v >= 100) {
+        unsigned r = (unsigned)(v % 100);
+        v /= 100;
+        end -= 2;
+        memcpy(end, digit_pairs + r * 2, 2);
+    }
+    if (v >= 10) {
+        end -= 2;
+        memcpy(end, digit_pairs + v * 2, 2);
+    } else {
+        *--end = (char)('0' + v);
+    }
+}
+
+int number_format_integer(char *dst, int64_t v) {
+    uint64_t u = (uint64_t)v;
+    int n = 0;
+    if (v < 0) {
+        dst[n++] = '-';
+        u = 0 - u;
+    }
+    int digits = count_digits(u);
+    write_digits(dst + n + digits, u);
+    return n + digits;
+}
+
+// 以下是Grisu2: 用64位定点数近似计算, 在舍入边界内生成尽量短的十进制数字, 结果总能精确读回
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_HIDDEN_BIT ((uint64_t)1 << DP_SIGNIFICAND_SIZE)
+#define DP_SIGNIFICAND_MASK (DP_HIDDEN_BIT - 1)
+
+struct diyfp {
+    uint64_t f;
+    int e;
+};
+
+// 10^-348, 10^-340, ..., 10^340 规格化后的有效位和二进制指数
+static const uint64_t cached_powers_f[] = {
+    0xfa8fd5a0081c0288, 0xbaaee17fa23ebf76, 0x8b16fb203055ac76, 0xcf42894a5dce35ea,
+    0x9a6bb0aa55653b2d, 0xe61acf033d1a45df, 0xab70fe17c79ac6ca, 0xff77b1fcbebcdc4f,
+    0xbe5691ef416bd60c, 0x8dd01fad907ffc3c, 0xd3515c2831559a83, 0x9d71ac8fada6c9b5,
+    0xea9c227723ee8bcb, 0xaecc49914078536d, 0x823c12795db6ce57, 0xc21094364dfb5637,
+    0x9096ea6f3848984f, 0xd77485cb25823ac7, 0xa086cfcd97bf97f4, 0xef340a98172aace5,
+    0xb23867fb2a35b28e, 0x84c8d4dfd2c63f3b, 0xc5dd44271ad3cdba, 0x936b9fcebb25c996,
+    0xdbac6c247d62a584, 0xa3ab66580d5fdaf6, 0xf3e2f893dec3f126, 0xb5b5ada8aaff80b8,
+    0x87625f056c7c4a8b, 0xc9bcff6034c13053, 0x964e858c91ba2655, 0xdff9772470297ebd,
+    0xa6dfbd9fb8e5b88f, 0xf8a95fcf88747d94, 0xb94470938fa89bcf, 0x8a08f0f8bf0f156b,
+    0xcdb02555653131b6, 0x993fe2c6d07b7fac, 0xe45c10c42a2b3b06, 0xaa242499697392d3,
+    0xfd87b5f28300ca0e, 0xbce5086492111aeb, 0x8cbccc096f5088cc, 0xd1b71758e219652c,
+    0x9c40000000000000, 0xe8d4a51000000000, 0xad78ebc5ac620000, 0x813f3978f8940984,
+    0xc097ce7bc90715b3, 0x8f7e32ce7bea5c70, 0xd5d238a4abe98068, 0x9f4f2726179a2245,
+    0xed63a231d4c4fb27, 0xb0de65388cc8ada8, 0x83c7088e1aab65db, 0xc45d1df942711d9a,
+    0x924d692ca61be758, 0xda01ee641a708dea, 0xa26da3999aef774a, 0xf209787bb47d6b85,
+    0xb454e4a179dd1877, 0x865b86925b9bc5c2, 0xc83553c5c8965d3d, 0x952ab45cfa97a0b3,
+    0xde469fbd99a05fe3, 0xa59bc234db398c25, 0xf6c69a72a3989f5c, 0xb7dcbf5354e9bece,
+    0x88fcf317f22241e2, 0xcc20ce9bd35c78a5, 0x98165af37b2153df, 0xe2a0b5dc971f303a,
+    0xa8d9d1535ce3b396, 0xfb9b7cd9a4a7443c, 0xbb764c4ca7a44410, 0x8bab8eefb6409c1a,
+    0xd01fef10a657842c, 0x9b10a4e5e9913129, 0xe7109bfba19c0c9d, 0xac2820d9623bf429,
+    0x80444b5e7aa7cf85, 0xbf21e44003acdd2d, 0x8e679c2f5e44ff8f, 0xd433179d9c8cb841,
+    0x9e19db92b4e31ba9, 0xeb96bf6ebadf77d9, 0xaf87023b9bf0ee6b,
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980, -954,
+    -927, -901, -874, -847, -821, -794, -768, -741, -715, -688, -661,
+    -635, -608, -582, -555, -529, -502, -475, -449, -422, -396, -369,
+    -343, -316, -289, -263, -236, -210, -183, -157, -130, -103, -77,
+    -50, -24, 3, 30, 56, 83, 109, 136, 162, 189, 216,
+    242, 269, 295, 322, 348, 375, 402, 428, 455, 481, 508,
+    534, 561, 588, 614, 641, 667, 694, 720, 747, 774, 800,
+    827, 853, 880, 907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static inline struct diyfp
+diyfp_mul(struct diyfp x, struct diyfp y) {
+    const uint64_t M32 = 0xFFFFFFFF;
+    uint64_t a = x.f >> 32, b = x.f & M32;
+    uint64_t c = y.f >> 32, d = y.f & M32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+    uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+    tmp += 1U << 31;    // 舍入
+    struct diyfp r = { ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+    return r;
+}
+
+static inline struct diyfp
+diyfp_normalize(struct diyfp x) {
+    int s = __builtin_clzll(x.f);
+    x.f <<= s;
+    x.e -= s;
+    return x;
+}
+
+// 取与w_e相乘后二进制指数落在[-60, -32]之间的10的幂, *K为对应的十进制指数的相反数
+static inline struct diyfp
+cached_power(int e, int *K) {
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (k != dk) k++;
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+    struct diyfp r = { cached_powers_f[index], cached_powers_e[index] };
+    return r;
+}
+
+static inline void
+grisu_round(char *buffer, int len, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w) {
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+            (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+        buffer[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static inline int
+count_digits32(uint32_t n) {
+    if (n < 10) return 1;
+    if (n < 100) return 2;
+    if (n < 1000) return 3;
+    if (n < 10000) return 4;
+    if (n < 100000) return 5;
+    if (n < 1000000) return 6;
+    if (n < 10000000) return 7;
+    if (n < 100000000) return 8;
+    if (n < 1000000000) return 9;
+    return 10;
+}
+
+static void
+digit_gen(struct diyfp w, struct diyfp mp, uint64_t delta, char *buffer, int *len, int *K) {
+    static const uint64_t pow10[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+        1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+        1000000000000000000ULL, 10000000000000000000ULL
+    };
+    struct diyfp one = { (uint64_t)1 << -mp.e, mp.e };
+    uint64_t wp_w = mp.f - w.f;
+    uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+    uint64_t p2 = mp.f & (one.f - 1);
+    int kappa = count_digits32(p1);
+    *len = 0;
+
+    // 整数部分
+    while (kappa > 0) {
+        uint32_t d = p1 / (uint32_t)pow10[kappa - 1];
+        p1 %= (uint32_t)pow10[kappa - 1];
+        if (d || *len)
+            buffer[(*len)++] = (char)('0' + d);
+        kappa--;
+        uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *K += kappa;
+            grisu_round(buffer, *len, delta, tmp, pow10[kappa] << -one.e, wp_w);
+            return;
+        }
+    }
+
+    // 小数部分
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || *len)
+            buffer[(*len)++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            grisu_round(buffer, *len, delta, p2, one.f, -kappa < 20 ? wp_w * pow10[-kappa] : 0);
+            return;
+        }
+    }
+}
+
+// v为正的有限数, buffer中生成十进制数字, 值为 buffer * 10^K
+static void
+grisu2(uint64_t bits, char *buffer, int *len, int *K) {
+    int biased_e = (int)(bits >> DP_SIGNIFICAND_SIZE);
+    struct diyfp v;
+    if (biased_e != 0) {
+        v.f = (bits & DP_SIGNIFICAND_MASK) + DP_HIDDEN_BIT;
+        v.e = biased_e - DP_EXPONENT_BIAS;
+    } else {
+        v.f = bits & DP_SIGNIFICAND_MASK;
+        v.e = 1 - DP_EXPONENT_BIAS;
+    }
+
+    // 与相邻两个浮点数的中点
+    struct diyfp plus = { (v.f << 1) + 1, v.e - 1 };
+    plus = diyfp_normalize(plus);
+    struct diyfp minus;
+    if (v.f == DP_HIDDEN_BIT && biased_e > 1) {
+        minus.f = (v.f << 2) - 1;
+        minus.e = v.e - 2;
+    } else {
+        minus.f = (v.f << 1) - 1;
+        minus.e = v.e - 1;
+    }
+    minus.f <<= minus.e - plus.e;
+    minus.e = plus.e;
+
+    struct diyfp c_mk = cached_power(plus.e, K);
+    struct diyfp w = diyfp_mul(diyfp_normalize(v), c_mk);
+    struct diyfp wp = diyfp_mul(plus, c_mk);
+    struct diyfp wm = diyfp_mul(minus, c_mk);
+    wm.f++;
+    wp.f--;
+    digit_gen(w, wp, wp.f - wm.f, buffer, len, K);
+}
+
+// 把len位数字和十进制指数K排成Lua数字字面量
+static int
+prettify(char *buffer, int len, int K) {
+    int kk = len + K;   // 小数点的位置
+    if (K >= 0 && kk <= 17) {
+        // 1234e7 -> 12340000000.0
+        memset(buffer + len, '0', K);
+        buffer[kk] = '.';
+        buffer[kk + 1] = '0';
+        return kk + 2;
+    }
+    if (kk > 0 && kk <= 17) {
+        // 1234e-2 -> 12.34
+        memmove(buffer + kk + 1, buffer + kk, len - kk);
+        buffer[kk] = '.';
+        return len + 1;
+    }
+    if (kk > -6 && kk <= 0) {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - kk;
+        memmove(buffer + offset, buffer, len);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        memset(buffer + 2, '0', -kk);
+        return len + offset;
+    }
+    // 1234e30 -> 1.234e33
+    int n;
+    if (len == 1) {
+        n = 1;
+    } else {
+        memmove(buffer + 2, buffer + 1, len - 1);
+        buffer[1] = '.';
+        n = len + 1;
+    }
+    buffer[n++] = 'e';
+    return n + number_format_integer(buffer + n, kk - 1);
+}
+
+int number_format_double(char *dst, double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    int n = 0;
+    // 按位判断, -ffast-math下isinf/isnan不可靠
+    if ((bits & 0x7FF0000000000000ULL) == 0x7FF0000000000000ULL) {
+        if (bits & DP_SIGNIFICAND_MASK) {
+            memcpy(dst, "(0/0)", 5);
+            return 5;
+        }
+        if (bits >> 63)
+            dst[n++] = '-';
+        memcpy(dst + n, "1e9999", 6);
+        return n + 6;
+    }
+    if (bits >> 63) {
+        dst[n++] = '-';
+        bits &= ~(1ULL << 63);
+    }
+    if (bits == 0) {
+        memcpy(dst + n, "0.0", 3);
+        return n + 3;
+    }
+    int len, K;
+    grisu2(bits, dst + n, &len, &K);
+    return n + prettify(dst + n, len, K);
+}
+
+// 10^0 ~ 10^22 都能用double精确表示
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int
+hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+size_t number_parse(const char *s, const char *end, int64_t *i, double *d, bool *isint) {
+    const char *p = s;
+    bool neg = false;
+    if (p < end && *p == '-') {
+        neg = true;
+        p++;
+    }
+
+    if (end - p >= 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+        // 十六进制整数按Lua的规则溢出回绕, 不支持十六进制浮点数
+        p += 2;
+        const char *digits = p;
+        uint64_t u = 0;
+        int h;
+        while (p < end && (h = hex_value(*p)) >= 0) {
+            u = (u << 4) | (uint64_t)h;
+            p++;
+        }
+        if (p == digits || (p < end && (*p == '.' || (*p | 0x20) == 'p')))
+            return 0;
+        *i = (int64_t)(neg ? 0 - u : u);
+        *isint = true;
+        return (size_t)(p - s);
+    }
+
+    // 有效数字最多累积19位, 之后的数字只记录数量级
+    uint64_t m = 0;
+    int digits = 0, exp10 = 0;
+    bool truncated = false, is_float = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+        if (m < 1000000000000000000ULL)
+            m = m * 10 + (uint64_t)(*p - '0');
+        else {
+            exp10++;
+            truncated = true;
+        }
+    }
+    if (p < end && *p == '.') {
+        is_float = true;
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+            if (m < 1000000000000000000ULL) {
+                m = m * 10 + (uint64_t)(*p - '0');
+                exp10--;
+            } else if (*p != '0') {
+                truncated = true;
+            }
+        }
+    }
+    if (digits == 0)
+        return 0;
+    if (p < end && (*p | 0x20) == 'e') {
+        is_float = true;
+        p++;
+        bool eneg = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            eneg = *p == '-';
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9')
+            return 0;
+        int e = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        }
+        exp10 += eneg ? -e : e;
+    }
+
+    if (!is_float && !truncated && (m <= INT64_MAX || (neg && m == (uint64_t)INT64_MAX + 1))) {
+        *i = (int64_t)(neg ? 0 - m : m);
+        *isint = true;
+        return (size_t)(p - s);
+    }
+
+    // 有效数字不超过2^53且10的幂可以精确表示时, 一次乘除就是正确舍入的结果; 否则交给strtod
+    double v;
+    if (!truncated && m <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22) {
+        v = (double)m;
+        if (exp10 < 0)
+            v /= exact_pow10[-exp10];
+        else
+            v *= exact_pow10[exp10];
+        if (neg)
+            v = -v;
+    } else {
+        char *endp;
+        v = strtod(s, &endp);
+        if (endp != p)
+            return 0;
+    }
+    *d = v;
+    *isint = false;
+    return (size_t)(p - s);
+}
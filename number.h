@@ -0,0 +1,21 @@
+#ifndef _NUMBER_H_
+#define _NUMBER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUMBER_INTEGER_MAX_LEN 20   // "-9223372036854775808"
+#define NUMBER_DOUBLE_MAX_LEN 32
+
+// 整数转十进制字符串, 返回写入的长度, 不写结尾的'\0'
+int number_format_integer(char *dst, int64_t v);
+// 浮点数转成读回时与原值完全相同的最短十进制(Grisu2), 结果总是带小数点或指数, 以便Lua 5.3+读回浮点数.
+// inf/nan写成Lua可以载入的1e9999, -1e9999, (0/0). 返回写入的长度, 不写结尾的'\0'
+int number_format_double(char *dst, double v);
+// 解析Lua数字字面量: 十进制整数/浮点数, 以及按Lua规则溢出回绕的十六进制整数, 可以带负号.
+// 结果是整数时*isint为true, 值写入*i; 超出int64的十进制整数与浮点数写入*d. 返回读取的长度, 不是数字时返回0.
+// [s, end)之后需要有不属于数字的字节(如Lua字符串结尾的'\0'), 以便交给strtod
+size_t number_parse(const char *s, const char *end, int64_t *i, double *d, bool *isint);
+
+#endif //_NUMBER_H_
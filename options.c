@@ -0,0 +1,174 @@
+#include <lauxlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "options.h"
+#include "codec.h"
+#include "dict.h"
+#include "schema.h"
+
+void options_default(struct options *opt) {
+    memset(opt, 0, sizeof(*opt));
+    opt->codec = CODEC_SNAPPY; // 默认使用Snappy压缩
+    opt->level = 1; // 默认压缩级别为1
+    opt->packed = 1;
+    opt->dict_ref = LUA_NOREF;
+    opt->schema_ref = LUA_NOREF;
+}
+
+struct options *options_test(lua_State *L, int index) {
+    void *p = lua_touserdata(L, index);
+    if (p == NULL || lua_type(L, index) != LUA_TUSERDATA)
+        return NULL;
+    if (!lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, OPTIONS_META);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? (struct options *)p : NULL;
+}
+
+// 从index处的table读取选项, 没有给出的字段保持默认值
+void options_parse(lua_State *L, int index, struct options *opt) {
+    options_default(opt);
+
+    lua_getfield(L, index, "codec");
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        const char *name = lua_tostring(L, -1);
+        opt->codec = codec_from_name(name);
+        if (opt->codec < 0) {
+            luaL_error(L, "未知的压缩类型: %s", name);
+        }
+    } else if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1)) {
+        opt->codec = CODEC_NONE;
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "level");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        opt->level = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    codec_check_level(L, opt->codec, opt->level);
+
+    lua_getfield(L, index, "checksum");
+    opt->checksum = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "workers");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        opt->workers = lua_tointeger(L, -1);
+        if (opt->workers < 0) {
+            luaL_error(L, "压缩线程数不能小于0");
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "job_size");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        opt->job_size = lua_tointeger(L, -1);
+        if (opt->job_size < 0) {
+            luaL_error(L, "任务长度不能小于0");
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "intern");
+    opt->intern = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "shared");
+    opt->shared = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "packed");
+    if (lua_type(L, -1) == LUA_TBOOLEAN) {
+        opt->packed = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "varint");
+    opt->varint = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "strip");
+    opt->strip = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "cache_functions");
+    opt->cache_functions = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "dict");
+    if (!lua_isnil(L, -1)) {
+        opt->dict = dict_test(L, -1);
+        if (opt->dict == NULL) {
+            luaL_error(L, "dict只能是cseri.train_dict或cseri.dict创建的字典");
+        }
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, index, "schema");
+    if (!lua_isnil(L, -1)) {
+        schema_push_list(L, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+}
+
+int options_ref_dict(lua_State *L, int index) {
+    struct options *opt = options_test(L, index);
+    if (opt) {
+        if (opt->dict == NULL)
+            return LUA_NOREF;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, opt->dict_ref);
+    } else if (lua_type(L, index) == LUA_TTABLE) {
+        lua_getfield(L, index, "dict");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            return LUA_NOREF;
+        }
+    } else {
+        return LUA_NOREF;
+    }
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+int options_ref_schema(lua_State *L, int index) {
+    lua_getfield(L, index, "schema");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return LUA_NOREF;
+    }
+    schema_push_list(L, lua_gettop(L));
+    lua_remove(L, -2);
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static int options_gc(lua_State *L) {
+    struct options *opt = (struct options *)lua_touserdata(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, opt->dict_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, opt->schema_ref);
+    opt->dict_ref = LUA_NOREF;
+    opt->schema_ref = LUA_NOREF;
+    opt->dict = NULL;
+    return 0;
+}
+
+int options_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    struct options opt;
+    options_parse(L, 1, &opt);
+
+    struct options *res = (struct options *)lua_newuserdata(L, sizeof(opt));
+    *res = opt;
+    if (luaL_newmetatable(L, OPTIONS_META)) {
+        lua_pushcfunction(L, options_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    res->dict_ref = options_ref_dict(L, 1);
+    res->schema_ref = options_ref_schema(L, 1);
+    return 1;
+}
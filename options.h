@@ -0,0 +1,37 @@
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include <lua.h>
+
+#define OPTIONS_META "cseri.options"
+
+struct dict;
+
+// cseri.options{...} 创建的选项, 可代替压缩方式和压缩级别传给tobin/frombin
+struct options {
+    int codec;
+    int level;
+    int checksum;
+    int workers;    // Zstd压缩线程数, 0为单线程
+    int job_size;   // Zstd多线程时每个任务的长度, 0为自动
+    int intern;     // 重复出现的短字符串只写一次, 之后写序号
+    int shared;     // 同一个table只写一次, 再次出现时写序号, 支持循环引用
+    int packed;     // 全是整数/浮点数/布尔值的数组紧密排列写出, 默认开启
+    int varint;     // 整数和长度用zigzag varint写出, 数据帧版本为2
+    int strip;      // 函数去掉调试信息写出, Lua 5.3以下的lua_dump不支持, 忽略
+    int cache_functions;    // 解析时按字节码缓存加载好的函数, 相同字节码返回同一个函数
+    struct dict *dict;  // Zstd和Zlib使用的压缩字典
+    int dict_ref;       // 选项对象对字典的引用
+    int schema_ref;     // schema字段表数组的引用, 没有schema时为LUA_NOREF
+};
+
+void options_default(struct options *opt);
+void options_parse(lua_State *L, int index, struct options *opt);
+struct options *options_test(lua_State *L, int index);
+int options_new(lua_State *L);
+// 引用index处选项(选项对象或table)中的字典, 保证字典在使用期间不被回收; 没有字典时返回LUA_NOREF
+int options_ref_dict(lua_State *L, int index);
+// 把index处table中的schema展开成字段表数组并引用; 没有schema时返回LUA_NOREF
+int options_ref_schema(lua_State *L, int index);
+
+#endif //_OPTIONS_H_
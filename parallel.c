@@ -0,0 +1,45 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include "parallel.h"
+
+struct parallel {
+    parallel_task task;
+    void *ud;
+    int count;
+    atomic_int next;
+};
+
+static void *parallel_worker(void *arg) {
+    struct parallel *p = (struct parallel *)arg;
+    for (;;) {
+        int i = atomic_fetch_add(&p->next, 1);
+        if (i >= p->count)
+            break;
+        p->task(p->ud, i);
+    }
+    return NULL;
+}
+
+void parallel_run(int threads, int count, parallel_task task, void *ud) {
+    struct parallel p;
+    p.task = task;
+    p.ud = ud;
+    p.count = count;
+    atomic_init(&p.next, 0);
+
+    if (threads > count)
+        threads = count;
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+
+    // 线程创建失败时由已有的线程分担, 结果不受影响
+    pthread_t tids[PARALLEL_MAX_THREADS];
+    int n = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&tids[n], NULL, parallel_worker, &p) == 0)
+            n++;
+    }
+    parallel_worker(&p);
+    for (int i = 0; i < n; i++)
+        pthread_join(tids[i], NULL);
+}
@@ -0,0 +1,12 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#define PARALLEL_MAX_THREADS 64
+
+typedef void (*parallel_task)(void *ud, int index);
+
+// 用threads个线程(包括调用线程)并行执行task(ud, 0) ~ task(ud, count - 1), 全部完成后返回.
+// task在工作线程中执行, 不能调用Lua API
+void parallel_run(int threads, int count, parallel_task task, void *ud);
+
+#endif //_PARALLEL_H_
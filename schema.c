@@ -0,0 +1,109 @@
+#include <lauxlib.h>
+#include <stdint.h>
+#include "common.h"
+#include "schema.h"
+
+static int schema_gc(lua_State *L) {
+    struct schema *s = (struct schema *)lua_touserdata(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, s->fields);
+    s->fields = LUA_NOREF;
+    s->count = 0;
+    return 0;
+}
+
+// s:fields() 返回字段名数组
+static int schema_fields(lua_State *L) {
+    struct schema *s = (struct schema *)luaL_checkudata(L, 1, SCHEMA_META);
+    lua_createtable(L, s->count, 0);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, s->fields);
+    for (int i = 1; i <= s->count; ++i) {
+        lua_rawgeti(L, -1, i);
+        lua_rawseti(L, -3, i);
+    }
+    lua_pop(L, 1);
+    return 1;
+}
+
+struct schema *schema_test(lua_State *L, int index) {
+    void *p = lua_touserdata(L, index);
+    if (p == NULL || lua_type(L, index) != LUA_TUSERDATA)
+        return NULL;
+    if (!lua_getmetatable(L, index))
+        return NULL;
+    luaL_getmetatable(L, SCHEMA_META);
+    int same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return same ? (struct schema *)p : NULL;
+}
+
+void schema_push_list(lua_State *L, int index) {
+    struct schema *s = schema_test(L, index);
+    if (s) {
+        lua_createtable(L, 1, 0);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, s->fields);
+        lua_rawseti(L, -2, 1);
+        return;
+    }
+    if (lua_type(L, index) != LUA_TTABLE) {
+        luaL_error(L, "schema只能是cseri.schema创建的对象或它们的数组");
+    }
+    int n = (int)lua_rawlen(L, index);
+    lua_createtable(L, n, 0);
+    for (int i = 1; i <= n; ++i) {
+        lua_rawgeti(L, index, i);
+        s = schema_test(L, -1);
+        if (s == NULL) {
+            luaL_error(L, "schema只能是cseri.schema创建的对象或它们的数组");
+        }
+        lua_pop(L, 1);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, s->fields);
+        lua_rawseti(L, -2, i);
+    }
+}
+
+// cseri.schema{"id", "name", ...} 编译字段布局. 只含这些字段(可以缺少一部分)的table按位置写出字段值, 不写key
+int schema_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int n = (int)lua_rawlen(L, 1);
+    if (n == 0) {
+        return luaL_error(L, "schema不能为空");
+    }
+    if (n > SCHEMA_MAX_FIELDS) {
+        return luaL_error(L, "schema最多只能有%d个字段", SCHEMA_MAX_FIELDS);
+    }
+
+    lua_createtable(L, n, n);
+    int fields = lua_gettop(L);
+    for (int i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 1, i);
+        if (lua_type(L, -1) != LUA_TSTRING) {
+            return luaL_error(L, "schema字段名必须是字符串");
+        }
+        lua_pushvalue(L, -1);
+        lua_rawget(L, fields);
+        if (!lua_isnil(L, -1)) {
+            return luaL_error(L, "schema字段名不能重复: %s", lua_tostring(L, -2));
+        }
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, fields, i);
+        lua_pushinteger(L, i);
+        lua_rawset(L, fields);
+    }
+
+    struct schema *s = (struct schema *)lua_newuserdata(L, sizeof(*s));
+    s->fields = LUA_NOREF;
+    s->count = n;
+    if (luaL_newmetatable(L, SCHEMA_META)) {
+        lua_pushcfunction(L, schema_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_newtable(L);
+        lua_pushcfunction(L, schema_fields);
+        lua_setfield(L, -2, "fields");
+        lua_setfield(L, -2, "__index");
+    }
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, fields);
+    s->fields = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef _SCHEMA_H_
+#define _SCHEMA_H_
+
+#include <lua.h>
+
+#define SCHEMA_META "cseri.schema"
+#define SCHEMA_MAX_FIELDS 0xffff
+
+// cseri.schema{...} 编译好的字段布局. 字段表中fields[i]为第i个字段名, fields[name]为字段序号
+struct schema {
+    int fields;     // 字段表的引用
+    int count;
+};
+
+struct schema *schema_test(lua_State *L, int index);
+// 把index处的schema或schema数组展开成字段表数组压入栈顶, 不是合法的schema时报错
+void schema_push_list(lua_State *L, int index);
+int schema_new(lua_State *L);
+
+#endif //_SCHEMA_H_
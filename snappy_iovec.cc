@@ -0,0 +1,16 @@
+#include "snappy.h"
+#include "snappy-c.h"
+
+extern "C" {
+
+// 直接压缩分散在多个数据块中的输入, 省去拼接成连续内存的拷贝
+int snappy_compress_iov(const struct iovec *iov, size_t input_length,
+                        char *compressed, size_t *compressed_length) {
+    if (*compressed_length < snappy_max_compressed_length(input_length)) {
+        return SNAPPY_BUFFER_TOO_SMALL;
+    }
+    snappy::RawCompressFromIOVec(iov, input_length, compressed, compressed_length);
+    return SNAPPY_OK;
+}
+
+}  // extern "C"
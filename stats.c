@@ -0,0 +1,70 @@
+#include <lauxlib.h>
+#include "codec.h"
+#include "stats.h"
+
+atomic_int stats_on;
+
+static _Atomic uint64_t counters[STATS_CODECS][STATS_COUNTERS];
+
+static const char *codec_names[STATS_CODECS] = {
+    [CODEC_NONE] = "none",
+    [CODEC_SNAPPY] = "snappy",
+    [CODEC_ZLIB] = "zlib",
+    [CODEC_ZSTD] = "zstd",
+};
+
+static const char *counter_names[STATS_COUNTERS] = {
+    [STATS_ENCODE_CALLS] = "encode_calls",
+    [STATS_ENCODE_RAW] = "encode_raw_bytes",
+    [STATS_ENCODE_COMPRESSED] = "encode_compressed_bytes",
+    [STATS_TRAVERSE_NS] = "traverse_ns",
+    [STATS_COMPRESS_NS] = "compress_ns",
+    [STATS_BLOCKS] = "blocks",
+    [STATS_DECODE_CALLS] = "decode_calls",
+    [STATS_DECODE_RAW] = "decode_raw_bytes",
+    [STATS_DECODE_COMPRESSED] = "decode_compressed_bytes",
+    [STATS_DECOMPRESS_NS] = "decompress_ns",
+    [STATS_MATERIALIZE_NS] = "materialize_ns",
+};
+
+void stats_add(int codec, int counter, uint64_t value) {
+    if (codec >= 0 && codec < STATS_CODECS)
+        atomic_fetch_add_explicit(&counters[codec][counter], value, memory_order_relaxed);
+}
+
+// cseri.stats() 返回各压缩方式的累计统计 {zstd = {encode_calls = ..., ...}, ...}
+// cseri.stats(true/false) 开启或关闭统计, 关闭时已有的计数保留
+int stats_get(lua_State *L) {
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        atomic_store_explicit(&stats_on, lua_toboolean(L, 1), memory_order_relaxed);
+        return 0;
+    }
+    lua_createtable(L, 0, STATS_CODECS + 1);
+    for (int c = 0; c < STATS_CODECS; ++c) {
+        lua_createtable(L, 0, STATS_COUNTERS);
+        for (int i = 0; i < STATS_COUNTERS; ++i) {
+            uint64_t v = atomic_load_explicit(&counters[c][i], memory_order_relaxed);
+#if LUA_VERSION_NUM < 503
+            lua_pushnumber(L, (lua_Number)v);
+#else
+            lua_pushinteger(L, (lua_Integer)v);
+#endif
+            lua_setfield(L, -2, counter_names[i]);
+        }
+        lua_setfield(L, -2, codec_names[c]);
+    }
+    lua_pushboolean(L, stats_enabled());
+    lua_setfield(L, -2, "enabled");
+    return 1;
+}
+
+// cseri.stats_reset() 清零全部计数, 不改变开关
+int stats_reset(lua_State *L) {
+    (void)L;
+    for (int c = 0; c < STATS_CODECS; ++c) {
+        for (int i = 0; i < STATS_COUNTERS; ++i)
+            atomic_store_explicit(&counters[c][i], 0, memory_order_relaxed);
+    }
+    return 0;
+}
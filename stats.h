@@ -0,0 +1,44 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <lua.h>
+
+#define STATS_CODECS 4
+
+// 每种压缩方式的累计计数
+enum {
+    STATS_ENCODE_CALLS,
+    STATS_ENCODE_RAW,           // 序列化后未压缩的长度
+    STATS_ENCODE_COMPRESSED,    // tobin结果的长度(含帧头)
+    STATS_TRAVERSE_NS,          // 遍历table并写出数据的时间
+    STATS_COMPRESS_NS,
+    STATS_BLOCKS,               // 新分配的数据块(块池中取出的不算)
+    STATS_DECODE_CALLS,
+    STATS_DECODE_RAW,
+    STATS_DECODE_COMPRESSED,
+    STATS_DECOMPRESS_NS,
+    STATS_MATERIALIZE_NS,       // 解析数据并创建Lua值的时间
+    STATS_COUNTERS
+};
+
+// tobin/frombin的运行统计, 进程内所有lua_State共用, 默认关闭. 关闭时每次调用只多读一次开关
+extern atomic_int stats_on;
+
+static inline int stats_enabled(void) {
+    return atomic_load_explicit(&stats_on, memory_order_relaxed);
+}
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_add(int codec, int counter, uint64_t value);
+int stats_get(lua_State *L);
+int stats_reset(lua_State *L);
+
+#endif //_STATS_H_
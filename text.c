@@ -1,10 +1,21 @@
 #include <lauxlib.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define TEXT_NEON
+#endif
 #include "common.h"
 #include "buffer.h"
+#include "number.h"
+
+#define NUMBER_MAX_LEN 64   // 数字转成字符串的最大长度, 直接写入buffer_reserve取得的空间
 
 static const char *char2escape[256] = {
     "\\x00", "\\x01", "\\x02", "\\x03",
@@ -59,14 +70,58 @@ is_name(const char *str, size_t len) {
     return true;
 }
 
+// 返回从i开始第一个需要转义的字节(控制字符, '"', '\\', 0x7f)的位置, 没有时返回len.
+// SSE2/NEON每次检查16字节, 剩余部分逐字节查表
+static size_t
+find_escape(const char *str, size_t i, size_t len) {
+#if defined(__SSE2__)
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(str + i));
+        // 无符号比较v <= 0x1f
+        __m128i m = _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, quote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, del));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(TEXT_NEON)
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)str + i);
+        uint8x16_t m = vcltq_u8(v, vdupq_n_u8(0x20));
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('"')));
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8('\\')));
+        m = vorrq_u8(m, vceqq_u8(v, vdupq_n_u8(0x7f)));
+        // 每字节的比较结果压成4位, 得到64位掩码
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask)
+            return i + (__builtin_ctzll(mask) >> 2);
+    }
+#endif
+    for (; i < len; ++i) {
+        if (char2escape[(unsigned char)str[i]])
+            return i;
+    }
+    return len;
+}
+
+// 不需要转义的连续字节一次写入
 inline static void
 append_escape_string(struct buffer *bf, const char *str, size_t len) {
-    for (size_t i = 0; i < len; ++i) {
-        const char *esc = char2escape[(unsigned char)str[i]];
-        if (esc)
-            buffer_append_str(bf, esc);
-        else
-            buffer_append_char(bf, str[i]);
+    size_t i = 0;
+    for (;;) {
+        size_t j = find_escape(str, i, len);
+        if (j > i)
+            buffer_append_lstr(bf, str + i, j - i);
+        if (j == len)
+            break;
+        buffer_append_str(bf, char2escape[(unsigned char)str[j]]);
+        i = j + 1;
     }
 }
 
@@ -78,25 +133,36 @@ _serialize(lua_State *L, int idx, struct buffer *bf, bool is_key, int depth) {
     }
 
     int type = lua_type(L, idx);
-    char numbuff[64] = {0};
     switch(type) {
     case LUA_TNIL:
         buffer_append_lstr(bf, "nil", 3);
         break;
     case LUA_TNUMBER: {
         if (is_key) buffer_append_char(bf, '[');
+        char *numbuff = buffer_reserve(bf, NUMBER_MAX_LEN);
+        int len;
 #if LUA_VERSION_NUM < 503
-        int len = lua_number2str(numbuff, lua_tonumber(L, idx));
-        buffer_append_lstr(bf, numbuff, len);
+        // 只有浮点数, 整数值按整数格式写出. 0保留为0.0, 以免-0丢掉符号
+        lua_Number n = lua_tonumber(L, idx);
+        if (n != 0 && lua_isinteger(L, idx)) {
+            len = number_format_integer(numbuff, (int64_t)n);
+        } else {
+            len = number_format_double(numbuff, (double)n);
+        }
 #else
         if (lua_isinteger(L, idx)) {
-            int len = lua_integer2str(numbuff, sizeof(numbuff), lua_tointeger(L, idx));
-            buffer_append_lstr(bf, numbuff, len);
+            lua_Integer i = lua_tointeger(L, idx);
+            // 十进制的最小整数会被Lua读成浮点数, 与string.format("%q")一样写成十六进制
+            if (i == LUA_MININTEGER) {
+                len = snprintf(numbuff, NUMBER_MAX_LEN, "0x%llx", (unsigned long long)(lua_Unsigned)i);
+            } else {
+                len = number_format_integer(numbuff, (int64_t)i);
+            }
         } else {
-            int len = lua_number2str(numbuff, sizeof(numbuff), lua_tonumber(L, idx));
-            buffer_append_lstr(bf, numbuff, len);
+            len = number_format_double(numbuff, (double)lua_tonumber(L, idx));
         }
 #endif
+        buffer_commit(bf, len);
         if (is_key) buffer_append_lstr(bf, "]=", 2);
         break;
     }
@@ -176,7 +242,7 @@ _serialize(lua_State *L, int idx, struct buffer *bf, bool is_key, int depth) {
 
 int to_txt(lua_State *L) {
     struct buffer bf;
-    buffer_initialize(&bf, L);
+    buffer_initialize_pooled(&bf, L);
 
     for (int i = 1; i <= lua_gettop(L); ++i) {
         if (i != 1)
@@ -189,3 +255,443 @@ int to_txt(lua_State *L) {
 
     return 1;
 }
+
+#define TEXT_HINTS_META "cseri.text_hints"
+
+// 预扫描得到的每个表的数组/哈希部分长度, 按'{'出现的顺序排列, 用于lua_createtable预分配
+struct table_hint {
+    int narr;
+    int nrec;
+};
+
+struct text_hints {
+    struct table_hint *data;
+    size_t count;
+    size_t cap;
+};
+
+struct text_parser {
+    lua_State *L;
+    const char *begin;
+    const char *p;
+    const char *end;
+    struct text_hints *hints;
+    size_t hint_pos;
+};
+
+static int
+text_hints_gc(lua_State *L) {
+    struct text_hints *h = (struct text_hints *)lua_touserdata(L, 1);
+    free(h->data);
+    h->data = NULL;
+    h->count = h->cap = 0;
+    return 0;
+}
+
+// 压入栈顶, 出错时随userdata一起回收
+static struct text_hints *
+text_hints_new(lua_State *L) {
+    struct text_hints *h = (struct text_hints *)lua_newuserdata(L, sizeof(*h));
+    memset(h, 0, sizeof(*h));
+    if (luaL_newmetatable(L, TEXT_HINTS_META)) {
+        lua_pushcfunction(L, text_hints_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    return h;
+}
+
+static void
+parse_error(struct text_parser *ps, const char *msg) {
+    int line = 1;
+    for (const char *c = ps->begin; c < ps->p && c < ps->end; ++c) {
+        if (*c == '\n') line++;
+    }
+    luaL_error(ps->L, "fromtxt: %s (第%d行)", msg, line);
+}
+
+inline static bool
+is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+inline static void
+skip_space(struct text_parser *ps) {
+    while (ps->p < ps->end && is_space(*ps->p))
+        ps->p++;
+}
+
+// 跳过p处开始的字符串, 返回结尾'"'之后的位置, 没有结尾时返回NULL
+static const char *
+skip_string(const char *p, const char *end) {
+    size_t len = end - p;
+    size_t i = 1;
+    for (;;) {
+        i = find_escape(p, i, len);
+        if (i >= len)
+            return NULL;
+        if (p[i] == '"')
+            return p + i + 1;
+        i += p[i] == '\\' ? 2 : 1;
+    }
+}
+
+// 预扫描: 按','和'='的个数估计每个表的数组和哈希部分长度, 顺便检查嵌套层数
+static void
+scan_hints(struct text_parser *ps) {
+    struct text_hints *h = ps->hints;
+    struct {
+        size_t index;
+        int commas;
+        int assigns;
+    } stack[MAX_DEPTH + 1];
+    int depth = 0;
+    char last = 0;
+    const char *p = ps->begin, *end = ps->end;
+    while (p < end) {
+        char c = *p;
+        switch (c) {
+        case '"':
+            p = skip_string(p, end);
+            if (p == NULL)
+                return;
+            last = c;
+            continue;
+        case '{':
+            if (depth > MAX_DEPTH) {
+                ps->p = p;
+                parse_error(ps, "表的嵌套层数过多");
+            }
+            if (h->count == h->cap) {
+                size_t cap = h->cap ? h->cap * 2 : 64;
+                struct table_hint *data = (struct table_hint *)realloc(h->data, cap * sizeof(*data));
+                if (data == NULL)
+                    luaL_error(ps->L, "内存分配失败");
+                h->data = data;
+                h->cap = cap;
+            }
+            // 没有匹配的'}'时保持为0
+            h->data[h->count].narr = 0;
+            h->data[h->count].nrec = 0;
+            stack[depth].index = h->count++;
+            stack[depth].commas = 0;
+            stack[depth].assigns = 0;
+            depth++;
+            break;
+        case '}':
+            if (depth == 0)
+                return;
+            depth--;
+            {
+                int items = last == '{' ? 0 : stack[depth].commas + 1;
+                struct table_hint *t = &h->data[stack[depth].index];
+                t->nrec = stack[depth].assigns;
+                t->narr = items > t->nrec ? items - t->nrec : 0;
+            }
+            break;
+        case ',':
+            if (depth > 0) stack[depth - 1].commas++;
+            break;
+        case '=':
+            if (depth > 0) stack[depth - 1].assigns++;
+            break;
+        default:
+            if (is_space(c)) {
+                p++;
+                continue;
+            }
+        }
+        last = c;
+        p++;
+    }
+}
+
+static void parse_value(struct text_parser *ps, int depth);
+
+static int
+parse_escape(const char *s, size_t *i, size_t len) {
+    if (*i >= len)
+        return -1;
+    char c = s[(*i)++];
+    switch (c) {
+    case 'a': return '\a';
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    case '\\': case '"': case '\'': case '\n':
+        return (unsigned char)c;
+    case 'x': {
+        int v = 0;
+        for (int k = 0; k < 2; ++k, ++*i) {
+            if (*i >= len || !isxdigit((unsigned char)s[*i]))
+                return -1;
+            char x = s[*i];
+            v = v * 16 + (isdigit((unsigned char)x) ? x - '0' : (x | 0x20) - 'a' + 10);
+        }
+        return v;
+    }
+    default:
+        if (isdigit((unsigned char)c)) {
+            int v = c - '0';
+            for (int k = 1; k < 3 && *i < len && isdigit((unsigned char)s[*i]); ++k, ++*i)
+                v = v * 10 + (s[*i] - '0');
+            return v <= 255 ? v : -1;
+        }
+        return -1;
+    }
+}
+
+// 没有转义时直接从原文创建字符串
+static void
+parse_string(struct text_parser *ps) {
+    lua_State *L = ps->L;
+    const char *s = ps->p + 1;
+    size_t len = ps->end - s;
+    size_t j = find_escape(s, 0, len);
+    if (j < len && s[j] == '"') {
+        lua_pushlstring(L, s, j);
+        ps->p = s + j + 1;
+        return;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    size_t i = 0;
+    for (;;) {
+        if (j > i)
+            luaL_addlstring(&b, s + i, j - i);
+        if (j >= len) {
+            parse_error(ps, "字符串缺少结尾的'\"'");
+        }
+        char c = s[j];
+        i = j + 1;
+        if (c == '"')
+            break;
+        if (c == '\\') {
+            int v = parse_escape(s, &i, len);
+            if (v < 0) {
+                ps->p = s + j;
+                parse_error(ps, "无效的转义字符");
+            }
+            luaL_addchar(&b, (char)v);
+        } else {
+            // 未转义的控制字符原样保留
+            luaL_addchar(&b, c);
+        }
+        j = find_escape(s, i, len);
+    }
+    luaL_pushresult(&b);
+    ps->p = s + i;
+}
+
+static void
+parse_number(struct text_parser *ps) {
+    int64_t i;
+    double d;
+    bool isint;
+    size_t n = number_parse(ps->p, ps->end, &i, &d, &isint);
+    if (n == 0)
+        parse_error(ps, "无效的数字");
+    ps->p += n;
+#if LUA_VERSION_NUM < 503
+    lua_pushnumber(ps->L, isint ? (lua_Number)i : (lua_Number)d);
+#else
+    if (isint)
+        lua_pushinteger(ps->L, (lua_Integer)i);
+    else
+        lua_pushnumber(ps->L, (lua_Number)d);
+#endif
+}
+
+inline static bool
+is_name_start(char c) {
+    return c == '_' || isalpha((unsigned char)c);
+}
+
+inline static bool
+is_name_char(char c) {
+    return c == '_' || isalnum((unsigned char)c);
+}
+
+static bool
+match_word(struct text_parser *ps, const char *word, size_t len) {
+    if ((size_t)(ps->end - ps->p) < len || memcmp(ps->p, word, len) != 0)
+        return false;
+    if (ps->p + len < ps->end && is_name_char(ps->p[len]))
+        return false;
+    ps->p += len;
+    return true;
+}
+
+inline static void
+expect_char(struct text_parser *ps, char c, const char *msg) {
+    skip_space(ps);
+    if (ps->p >= ps->end || *ps->p != c)
+        parse_error(ps, msg);
+    ps->p++;
+}
+
+// 栈顶依次是表, 键, 值; 值为nil时不赋值
+inline static void
+set_field(lua_State *L) {
+    if (lua_isnil(L, -1))
+        lua_pop(L, 2);
+    else
+        lua_rawset(L, -3);
+}
+
+static void
+parse_table(struct text_parser *ps, int depth) {
+    lua_State *L = ps->L;
+    if (depth > MAX_DEPTH)
+        parse_error(ps, "表的嵌套层数过多");
+    luaL_checkstack(L, LUA_MINSTACK, NULL);
+    struct text_hints *h = ps->hints;
+    if (ps->hint_pos < h->count) {
+        struct table_hint *t = &h->data[ps->hint_pos++];
+        // 每个元素至少占一个字节, 预分配不超过剩余的文本长度
+        size_t left = ps->end - ps->p;
+        int narr = (size_t)t->narr < left ? t->narr : (int)(left < INT_MAX ? left : INT_MAX);
+        int nrec = (size_t)t->nrec < left ? t->nrec : (int)(left < INT_MAX ? left : INT_MAX);
+        lua_createtable(L, narr, nrec);
+    } else {
+        lua_newtable(L);
+    }
+    ps->p++;
+
+    int n = 0;
+    for (;;) {
+        skip_space(ps);
+        if (ps->p >= ps->end)
+            parse_error(ps, "表缺少结尾的'}'");
+        char c = *ps->p;
+        if (c == '}')
+            break;
+        if (c == '[') {
+            ps->p++;
+            parse_value(ps, depth + 1);
+            expect_char(ps, ']', "缺少']'");
+            expect_char(ps, '=', "缺少'='");
+            parse_value(ps, depth + 1);
+            if (lua_isnil(L, -2))
+                parse_error(ps, "表的键不能是nil");
+            set_field(L);
+        } else {
+            bool keyed = false;
+            if (is_name_start(c)) {
+                const char *name = ps->p;
+                while (ps->p < ps->end && is_name_char(*ps->p))
+                    ps->p++;
+                size_t len = ps->p - name;
+                skip_space(ps);
+                if (ps->p < ps->end && *ps->p == '=') {
+                    ps->p++;
+                    lua_pushlstring(L, name, len);
+                    parse_value(ps, depth + 1);
+                    set_field(L);
+                    keyed = true;
+                } else {
+                    ps->p = name;
+                }
+            }
+            if (!keyed) {
+                parse_value(ps, depth + 1);
+                ++n;
+                if (lua_isnil(L, -1))
+                    lua_pop(L, 1);
+                else
+                    lua_rawseti(L, -2, n);
+            }
+        }
+        skip_space(ps);
+        if (ps->p < ps->end && (*ps->p == ',' || *ps->p == ';'))
+            ps->p++;
+        else if (ps->p >= ps->end || *ps->p != '}')
+            parse_error(ps, "缺少','或'}'");
+    }
+    ps->p++;
+}
+
+static void
+parse_value(struct text_parser *ps, int depth) {
+    lua_State *L = ps->L;
+    skip_space(ps);
+    if (ps->p >= ps->end)
+        parse_error(ps, "缺少值");
+    char c = *ps->p;
+    switch (c) {
+    case '{':
+        parse_table(ps, depth);
+        return;
+    case '"':
+        parse_string(ps);
+        return;
+    case '(':
+        if ((size_t)(ps->end - ps->p) >= 5 && memcmp(ps->p, "(0/0)", 5) == 0) {
+            // 按位构造nan, -ffast-math下0.0/0.0不可靠
+            uint64_t bits = 0x7FF8000000000000ULL;
+            double nan;
+            memcpy(&nan, &bits, sizeof(nan));
+            lua_pushnumber(L, (lua_Number)nan);
+            ps->p += 5;
+            return;
+        }
+        break;
+    case 't':
+        if (match_word(ps, "true", 4)) {
+            lua_pushboolean(L, 1);
+            return;
+        }
+        break;
+    case 'f':
+        if (match_word(ps, "false", 5)) {
+            lua_pushboolean(L, 0);
+            return;
+        }
+        break;
+    case 'n':
+        if (match_word(ps, "nil", 3)) {
+            lua_pushnil(L);
+            return;
+        }
+        break;
+    default:
+        if (c == '-' || c == '.' || isdigit((unsigned char)c)) {
+            parse_number(ps);
+            return;
+        }
+    }
+    parse_error(ps, "无法识别的值");
+}
+
+// cseri.fromtxt(str) 解析totxt的输出, 返回其中的各个值. 只接受nil, 布尔值, 数字, 字符串和表,
+// 不会执行任何代码
+int from_txt(lua_State *L) {
+    size_t len;
+    const char *str = luaL_checklstring(L, 1, &len);
+    lua_settop(L, 1);
+
+    struct text_parser ps;
+    ps.L = L;
+    ps.begin = ps.p = str;
+    ps.end = str + len;
+    ps.hints = text_hints_new(L);
+    ps.hint_pos = 0;
+    scan_hints(&ps);
+
+    int n = 0;
+    skip_space(&ps);
+    while (ps.p < ps.end) {
+        if (n > 0) {
+            expect_char(&ps, ',', "缺少','");
+        }
+        luaL_checkstack(L, LUA_MINSTACK, NULL);
+        parse_value(&ps, 0);
+        n++;
+        skip_space(&ps);
+    }
+    return n;
+}